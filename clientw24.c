@@ -15,6 +15,8 @@ Advanced System Programming - 2
 #include <fcntl.h> // Include File Control options for file handling operations
 #include <time.h> // Include Time functions for manipulating and formatting time
 #include <signal.h> // Include Signal handling functionalities
+#include <stdint.h> // Include fixed size integer types for the frame header
+#include <endian.h> // Include byte order conversions for the 64-bit payload length
 
 #define O_BINARY 0 // Define O_BINARY as 0 for compatibility (relevant in Windows for file mode)
 
@@ -22,13 +24,32 @@ Advanced System Programming - 2
 #define SERVER_PORT 8082      // Define the port number on which the server will listen
 #define BUFFER_SIZE 10000     // Define buffer size for data transfer
 #define MAX_PATH_LENGTH 4096  // Define maximum path length for file paths
-#define MAX_ARGS 10           // Define maximum number of arguments in commands
+#define MAX_ARGS 64           // Define maximum number of arguments in commands, w24ft takes one per extension
+#define MAX_REDIRECTS 3       // Define how many redirects the client follows before giving up
+#define MAX_BATCH 100         // Define how many commands one line may batch together with ';'
+
+// Framed protocol spoken with the server: every request and every reply is a header followed by a payload.
+// An archive streamed while the server builds it comes as FRAME_ARCHIVE_PART frames, ended by an empty one.
+#define FRAME_MAGIC 0xF7      // Define the first byte of every frame
+
+enum { FRAME_REQUEST = 1, FRAME_TEXT, FRAME_ARCHIVE, FRAME_ARCHIVE_PART }; // Frame types
+enum { STATUS_OK, STATUS_NOT_FOUND, STATUS_ERROR, STATUS_BAD_REQUEST }; // Reply status codes
+
+// Header of a frame, multi-byte fields are in network byte order
+typedef struct {
+    uint8_t magic;       // Always FRAME_MAGIC
+    uint8_t type;        // FRAME_REQUEST, FRAME_TEXT, FRAME_ARCHIVE or FRAME_ARCHIVE_PART
+    uint8_t status;      // Status of the reply, 0 in requests
+    uint8_t reserved;    // Always 0
+    uint32_t request_id; // Id of the request, copied by the server into its reply
+    uint64_t length;     // Number of payload bytes after the header
+} frame_header_t;
 
 FILE *fp; // Declare a file pointer to be used globally
 // Helper function to check if the filename is safe
 int is_safe_filename(char *filename) {
     // Add any other checks as necessary
-    if (strchr(filename, '') != NULL || strchr(filename, ';') != NULL) {
+    if (strchr(filename, '\'') != NULL || strchr(filename, ';') != NULL) {
         return 0; // Unsafe characters found
     }
     return 1; // Safe
@@ -43,7 +64,8 @@ void unzip_tar_file(char *tar_filename) {
     }
 
     char command[MAX_PATH_LENGTH + 50]; // Extra space for command format
-    int status = snprintf(command, sizeof(command), "tar -xzf '%s' -C .", tar_filename);
+    // tar finds out by itself whether the archive is compressed, stored archives (-s) are plain tar files
+    int status = snprintf(command, sizeof(command), "tar -xf '%s' -C .", tar_filename);
 
     if (status < 0 || status >= sizeof(command)) {
         fprintf(stderr, "Failed to prepare command. Aborting.\n");
@@ -59,80 +81,247 @@ void unzip_tar_file(char *tar_filename) {
     printf("File unzipped...\n");
 }
 
-void receive_file(int socketfd, int unzipProcess) {
-    int pid = fork(); // Forks the current process to create a child process
-    if (pid == -1) { // Checks if fork failed
-        perror("fork"); // Prints the error related to fork failure
-        exit(EXIT_FAILURE); // Exits the program indicating failure
+// Reads exactly length bytes from the server, returns 0 on success or -1 if the connection closed first
+int receive_all(int socketfd, void *data, size_t length) {
+    size_t received = 0; // Number of bytes read so far
+    while (received < length) {
+        ssize_t bytes = recv(socketfd, (char *)data + received, length - received, 0); // Read what has arrived
+        if (bytes <= 0) {
+            return -1; // Connection closed or failed
+        }
+        received += bytes; // Add to the running total
     }
+    return 0;
+}
 
-    if (pid == 0) { // Checks if this is the child process (fork returns 0 to the child process)
-        char buffer[BUFFER_SIZE]; // Creates a buffer to store the data received from the socket
-        const char *tarName = "temp.tar.gz"; // Sets the name of the file to be created
+// Saves an archive sent by the server under tarName, returns -1 if the connection is lost. The header is that
+// of the whole archive, or of its first part if it comes in parts.
+int receive_file(int socketfd, const frame_header_t *header, int unzipProcess, const char *tarName) {
+    char buffer[BUFFER_SIZE]; // Creates a buffer to store the data received from the socket
 
-        // Opens/creates a file for writing only. If the file does not exist, it will be created with user read/write permissions. S_IRUSR sets the permission for the file owner to read the file. S_IWUSR sets the permission for the file owner to write to the file. 
-        int fd = open(tarName, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR); 
-        if (fd == -1) { // Checks if opening/creating the file failed
-            perror("open"); // Prints the error related to file open/create failure
-            exit(EXIT_FAILURE); // Exits the program indicating failure
-        }
+    // Opens/creates the file for writing only, replacing the archive of an earlier command
+    int fd = open(tarName, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) { // Checks if opening/creating the file failed
+        perror("open"); // Prints the error related to file open/create failure
+        exit(EXIT_FAILURE); // Exits the program indicating failure
+    }
 
-        ssize_t bytes_received = 0; // Initializes a variable to store the number of bytes received
-        long int total_bytes_received = 0; // Initializes a variable to keep the running total of bytes received
-        // Receives data from the socket until there's nothing left to read
-        while ((bytes_received = recv(socketfd, buffer, BUFFER_SIZE, 0)) > 0) { 
-            if (write(fd, buffer, bytes_received) != bytes_received) { // Writes the received data to file and checks for errors
+    // The size of every frame is known up front, so the client reads exactly the archive and the connection stays usable
+    frame_header_t part = *header; // Header of the frame being read
+    uint64_t total_bytes_received = 0; // Keeps the running total of bytes received
+    for (;;) {
+        uint64_t length = be64toh(part.length); // Size of this frame
+        uint64_t received = 0; // Bytes of this frame read so far
+        while (received < length) {
+            size_t chunk = length - received < BUFFER_SIZE ? length - received : BUFFER_SIZE;
+            if (receive_all(socketfd, buffer, chunk) < 0) { // Checks if the server went away mid-transfer
+                fprintf(stderr, "Error: Connection closed during file transfer\n");
+                close(fd); // Closes the file descriptor
+                return -1;
+            }
+            if (write(fd, buffer, chunk) != (ssize_t)chunk) { // Writes the received data to file and checks for errors
                 perror("write"); // Prints the error related to write failure
                 close(fd); // Closes the file descriptor
                 exit(EXIT_FAILURE); // Exits the program indicating failure
             }
-            total_bytes_received += bytes_received; // Adds the number of bytes received to the total
+            received += chunk;
         }
-
-        if (bytes_received == -1) { // Checks if there was an error receiving data
-            perror("recv"); // Prints the error related to recv failure
+        total_bytes_received += length; // Adds the number of bytes received to the total
+        if (part.type != FRAME_ARCHIVE_PART || length == 0) {
+            break; // The whole archive, or its empty last part
+        }
+        // The parts of one archive follow each other, nothing else is sent in between
+        if (receive_all(socketfd, &part, sizeof(part)) < 0 || part.magic != FRAME_MAGIC ||
+            part.type != FRAME_ARCHIVE_PART || part.request_id != header->request_id) {
+            fprintf(stderr, "Error: Connection closed during file transfer\n");
             close(fd); // Closes the file descriptor
-            exit(EXIT_FAILURE); // Exits the program indicating failure
+            return -1;
         }
+    }
+    close(fd); // Closes the file descriptor
 
-        // Prints a message based on whether any bytes were received
-        printf(total_bytes_received > 0 ? "File received successfully.\n" : "No files found.\n");
-        printf("Total file received %ld bytes.\n", total_bytes_received); // Prints the total bytes received
+    // Prints a message based on whether any bytes were received
+    printf(total_bytes_received > 0 ? "File received successfully.\n" : "No files found.\n");
+    printf("Total file received %llu bytes.\n", (unsigned long long)total_bytes_received); // Prints the total bytes received
 
-        close(fd); // Closes the file descriptor
-        exit(EXIT_SUCCESS); // Exits the child process successfully
-    } else { // This block is executed by the parent process
-        printf("File reception initiated...\n"); // Indicates that file reception has started
-        if (unzipProcess == 1) {
-            // This would attempt to unzip potentially before the file is fully received.
-            // Consider reworking logic for when unzip should occur.
-            sleep(5); // Consider removing or reworking this delay
-            unzip_tar_file("temp.tar.gz");
+    if (unzipProcess == 1 && total_bytes_received > 0) {
+        unzip_tar_file((char *)tarName); // The whole archive is on disk, no need to wait for it
     }
+    return 0;
 }
+
+// Sends one command to the server as a request frame
+int send_request(int socketfd, uint32_t request_id, const char *command) {
+    size_t length = strcspn(command, "\n"); // The frame carries the command without its newline
+    frame_header_t header = {
+        .magic = FRAME_MAGIC,
+        .type = FRAME_REQUEST,
+        .request_id = htonl(request_id),
+        .length = htobe64(length),
+    };
+    if (write(socketfd, &header, sizeof(header)) != sizeof(header) || write(socketfd, command, length) != (ssize_t)length) {
+        perror("Error: Failed to send command"); // Print the error message
+        return -1;
+    }
+    return 0;
 }
 
-int main() {
-    int client_socket; // Declare variable to hold the client socket descriptor
-    struct sockaddr_in server_addr; // Declare a structure to hold the server's address information
-    char buffer[BUFFER_SIZE]; // Declare a buffer for storing received data
-    ssize_t bytes_received; // Declare a variable to store the number of bytes received from the server
-    ssize_t read_bytes; // Variable to store the number of bytes to read (unused in this segment)
-    int file_fd; // File descriptor for the file being received (unused in this segment)
+// Reads the payload of a reply: archives are saved as tarName (and unzipped if asked for), text is printed
+// after the prefix. Returns -1 if the connection to the server is lost.
+int receive_payload(int socketfd, const frame_header_t *header, int unzipProcess, const char *tarName, const char *prefix) {
+    uint64_t length = be64toh(header->length); // Size of the payload
+    if (header->type == FRAME_ARCHIVE || header->type == FRAME_ARCHIVE_PART) {
+        return receive_file(socketfd, header, unzipProcess, tarName); // Save the archive
+    }
 
-    // Create a socket with AF_INET (IPv4), SOCK_STREAM (TCP), and protocol 0 (IP)
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    char *text = malloc(length + 1); // Buffer for the text reply
+    if (text == NULL || receive_all(socketfd, text, length) < 0) {
+        fprintf(stderr, "Error: Lost the connection to the server\n");
+        free(text);
+        return -1;
+    }
+    text[length] = '\0'; // Null-terminate the reply
+    if (header->status == STATUS_BAD_REQUEST && length == 0) {
+        printf("Bad Request! Command not supported by server\n");
+    } else {
+        printf("%s%s\n", prefix, text); // Print the server's reply
+    }
+    free(text);
+    return 0;
+}
+
+// Reads the reply to the request that was just sent, an archive is saved as tarName.
+// Returns -1 if the connection to the server is lost.
+int receive_reply(int socketfd, uint32_t request_id, int unzipProcess, const char *tarName, const char *prefix) {
+    frame_header_t header; // Header of the reply
+    if (receive_all(socketfd, &header, sizeof(header)) < 0 || header.magic != FRAME_MAGIC ||
+        ntohl(header.request_id) != request_id) {
+        fprintf(stderr, "Error: Lost the connection to the server\n");
+        return -1;
+    }
+    return receive_payload(socketfd, &header, unzipProcess, tarName, prefix);
+}
+
+// Tells whether the archive a command returns should be unpacked, with the same rules as single commands
+int wants_unzip(const char *command) {
+    size_t length = strlen(command); // Length of the command
+    while (length > 0 && command[length - 1] == ' ') {
+        length--; // Ignore trailing spaces
+    }
+    return strncmp(command, "w24ft ", 6) == 0 || strncmp(command, "w24fdb ", 7) == 0 ||
+           strncmp(command, "w24fda ", 7) == 0 || (length > 3 && strncmp(command + length - 3, " -u", 3) == 0);
+}
+
+// Tells whether a command asks for a stored archive: a plain tar, not compressed
+int wants_store(const char *command) {
+    for (const char *flag = strstr(command, " -s"); flag != NULL; flag = strstr(flag + 1, " -s")) {
+        if (flag[3] == '\0' || flag[3] == ' ' || flag[3] == '\n') {
+            return 1; // "-s" on its own, not the start of a longer argument
+        }
+    }
+    return 0;
+}
+
+// Removes every "-s" from the arguments of a command, returns 1 if there was one
+int take_store_flag(char **args, int *num_args) {
+    int store = 0; // Whether the flag was found
+    int kept = 1; // Arguments kept so far, the command itself included
+    for (int i = 1; i < *num_args; i++) {
+        if (strcmp(args[i], "-s") == 0) {
+            store = 1;
+        } else {
+            args[kept++] = args[i];
+        }
+    }
+    *num_args = kept;
+    args[kept] = NULL;
+    return store;
+}
+
+// Sends every ';'-separated command of the line back to back, then prints the replies in the order they arrive.
+// The server runs the commands concurrently, so the whole batch costs one round trip instead of one per command.
+// Returns -1 if the connection to the server is lost.
+int run_batch(int socketfd, char *line, uint32_t *request_id) {
+    char *commands[MAX_BATCH]; // The commands of the batch
+    int count = 0; // Number of commands in the batch
+    char *saveptr; // State of strtok_r
+    for (char *part = strtok_r(line, ";\n", &saveptr); part != NULL && count < MAX_BATCH; part = strtok_r(NULL, ";\n", &saveptr)) {
+        part += strspn(part, " "); // Skip the spaces after a ';'
+        if (*part != '\0') {
+            commands[count++] = part; // Keep the non-empty commands
+        }
+    }
+
+    // Put all the request frames in one buffer so they leave together
+    size_t total = 0; // Size of all the frames
+    for (int i = 0; i < count; i++) {
+        total += sizeof(frame_header_t) + strlen(commands[i]);
+    }
+    char *frames = malloc(total); // Buffer holding all the frames
+    if (frames == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t first_id = *request_id + 1; // Id of the first command, the others follow in order
+    size_t offset = 0; // Where the next frame goes
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(commands[i]); // Length of the command
+        frame_header_t header = {
+            .magic = FRAME_MAGIC,
+            .type = FRAME_REQUEST,
+            .request_id = htonl(first_id + i),
+            .length = htobe64(length),
+        };
+        memcpy(frames + offset, &header, sizeof(header));
+        memcpy(frames + offset + sizeof(header), commands[i], length);
+        offset += sizeof(header) + length;
+    }
+    *request_id += count; // Ids used by this batch
+
+    for (offset = 0; offset < total;) {
+        ssize_t written = write(socketfd, frames + offset, total - offset); // Send what the socket takes
+        if (written <= 0) {
+            perror("Error: Failed to send commands");
+            free(frames);
+            return -1;
+        }
+        offset += written;
+    }
+    free(frames);
+    printf("Sent %d commands\n", count);
+
+    // Replies come back as soon as each command is done, the request id tells which command it answers
+    for (int received = 0; received < count; received++) {
+        frame_header_t header; // Header of the next reply
+        if (receive_all(socketfd, &header, sizeof(header)) < 0 || header.magic != FRAME_MAGIC ||
+            ntohl(header.request_id) - first_id >= (uint32_t)count) {
+            fprintf(stderr, "Error: Lost the connection to the server\n");
+            return -1;
+        }
+        uint32_t id = ntohl(header.request_id); // Request this reply belongs to
+        char tarName[64]; // Every archive of the batch gets its own file
+        snprintf(tarName, sizeof(tarName), wants_store(commands[id - first_id]) ? "temp-%u.tar" : "temp-%u.tar.gz", id);
+        printf("\n[%s]\n", commands[id - first_id]); // Say which command the reply is for
+        if (receive_payload(socketfd, &header, wants_unzip(commands[id - first_id]), tarName, "") < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Connects to the given server and returns the socket
+int connect_to_server(const char *ip, int port) {
+    struct sockaddr_in server_addr; // Structure to hold the server's address information
+    int client_socket = socket(AF_INET, SOCK_STREAM, 0); // Create a TCP socket
     if (client_socket == -1) { // Check if socket creation failed
         perror("Error: Failed to create socket"); // Print the error message
         exit(1); // Exit the program with a status code of 1
     }
 
-    // Initialize the server address structure with zeros
-    memset(&server_addr, 0, sizeof(server_addr));
+    memset(&server_addr, 0, sizeof(server_addr)); // Initialize the server address structure with zeros
     server_addr.sin_family = AF_INET; // Set the family to IPv4
-    // Convert and set the server IP address from string to binary form
-    server_addr.sin_port = htons(SERVER_PORT); // Convert and set the server port number (host to network short)
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) == -1) { // Convert and check if IP conversion failed
+    server_addr.sin_port = htons(port); // Convert and set the server port number (host to network short)
+    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) != 1) { // Convert and check if IP conversion failed
         perror("inet_pton"); // Print the error message
         exit(EXIT_FAILURE); // Exit the program indicating failure
     }
@@ -142,18 +331,86 @@ int main() {
         perror("Error: Failed to connect to server"); // Print the error message if connection failed
         exit(1); // Exit the program with a status code of 1
     }
+    return client_socket;
+}
+
+// Reads one line sent by the server, returns its length or -1 if the connection closed first
+int receive_line(int socketfd, char *line, int size) {
+    int length = 0; // Number of characters stored so far
+    while (length < size - 1) {
+        char c;
+        if (recv(socketfd, &c, 1, 0) != 1) { // Read one character at a time, the line is short
+            return -1; // Connection closed or failed
+        }
+        if (c == '\n') {
+            break; // End of the line
+        }
+        line[length++] = c; // Store the character
+    }
+    line[length] = '\0'; // Null-terminate the line
+    return length;
+}
+
+// Connects to the main server and follows its redirect to a mirror, if any, returns the connected socket
+int connect_and_follow_redirects(char *ip, int *port) {
+    for (int hops = 0; hops <= MAX_REDIRECTS; hops++) {
+        int client_socket = connect_to_server(ip, *port); // Connect to the current server
+        char line[200]; // Buffer for the server's answer
+
+        // Say hello, the server answers w24ok or tells the client which mirror to use
+        if (write(client_socket, "w24hello\n", 9) != 9 || receive_line(client_socket, line, sizeof(line)) < 0) {
+            fprintf(stderr, "Error: Server closed the connection during the handshake\n");
+            exit(1);
+        }
+
+        char new_ip[INET_ADDRSTRLEN]; // Address of the mirror to reconnect to
+        int new_port; // Port of the mirror to reconnect to
+        if (sscanf(line, "w24redirect %15s %d", new_ip, &new_port) == 2) {
+            printf("Redirected to %s:%d\n", new_ip, new_port); // Tell the user where the client goes
+            close(client_socket); // The main server closes its side as well
+            strcpy(ip, new_ip); // Remember the new server
+            *port = new_port;
+            continue; // Connect again, this time to the mirror
+        }
+        return client_socket; // Server is keeping this client
+    }
+    fprintf(stderr, "Error: Too many redirects\n");
+    exit(1);
+}
+
+int main() {
+    int client_socket; // Declare variable to hold the client socket descriptor
+    char server_ip[INET_ADDRSTRLEN] = SERVER_IP; // Address of the server the client ends up talking to
+    int server_port = SERVER_PORT; // Port of the server the client ends up talking to
+    char buffer[BUFFER_SIZE]; // Declare a buffer for storing received data
+    ssize_t bytes_received; // Declare a variable to store the number of bytes received from the server
+    ssize_t read_bytes; // Variable to store the number of bytes to read (unused in this segment)
+    int file_fd; // File descriptor for the file being received (unused in this segment)
+
+    // Connect to the main server, which may hand the client over to one of the mirrors
+    client_socket = connect_and_follow_redirects(server_ip, &server_port);
 
     // Print confirmation of successful connection
-    printf("\nConnected to server: %s:%d\n", SERVER_IP, SERVER_PORT);
-    char command[1000], server_reply[2000]; // Declare arrays for storing commands and server replies
+    printf("\nConnected to server: %s:%d\n", server_ip, server_port);
+    char command[BUFFER_SIZE]; // Declare an array for storing commands, large enough for a batch
+    uint32_t request_id = 0; // Id of the last request sent to the server
     char *args[MAX_ARGS]; // Declare an array of pointers for command arguments
     int num_args; // Declare a variable for counting the number of arguments
 
     // Loop indefinitely to send and receive commands
     while (1) {
         printf("clientw24: "); // Prompt the user for a command
-        fgets(command, 1000, stdin); // Read the command from standard input
-        char temp[1000]; // Declare a temporary array to hold the command
+        if (fgets(command, sizeof(command), stdin) == NULL) { // Read the command from standard input
+            break; // End of input
+        }
+        // Several commands separated by ';' are sent as one pipelined batch
+        if (strchr(command, ';') != NULL) {
+            if (run_batch(client_socket, command, &request_id) < 0) {
+                break; // The connection is gone
+            }
+            continue;
+        }
+        char temp[BUFFER_SIZE]; // Declare a temporary array to hold the command
         sprintf(temp, "%s", command); // Copy the command into the temporary array
         // Tokenize the command string into arguments
         num_args = 0; // Initialize the argument count to 0
@@ -167,13 +424,32 @@ int main() {
         int command_valid_flag = 0; // Initialize a flag to check if a valid command has been entered
 int file_flag = 0; // Initialize a flag to check if the operation involves dealing with files
 int unzip = 0; //Initialize a flag to check the unzip file function
+int store = 0; // Initialize a flag to check if a plain tar was asked for with -s
+
+// The archive commands take "-s" anywhere after the command, it is checked apart from the other arguments
+if (strcmp(args[0], "w24fz") == 0 || strcmp(args[0], "w24ft") == 0 || strcmp(args[0], "w24fdb") == 0 || strcmp(args[0], "w24fda") == 0) {
+    store = take_store_flag(args, &num_args);
+}
 
 // Check if the first argument (command) is "w24fn" which  stand for "find file by name"
 if (strcmp(args[0], "w24fn") == 0) {
     file_flag = 0; // Explicitly setting file_flag to 0, indicating no file transfer is expected
     printf("File Search Operation Invoked\n"); // Notify that the findfiles command has been invoked
-    if (num_args != 2) { // Check if the correct number of arguments is provided
-        fprintf(stderr, "Usage: %s filename\n", args[0]); // If not, print the correct usage
+    // -a asks for every file with that name instead of the first one found
+    if (num_args != 2 && !(num_args == 3 && strcmp(args[2], "-a") == 0)) { // Check if the correct number of arguments is provided
+        fprintf(stderr, "Usage: %s filename [-a]\n", args[0]); // If not, print the correct usage
+    } else {
+        command_valid_flag = 1; // If correct, set the command valid flag
+    }
+}
+
+// Check if the first argument (command) is "w24fp" which stands for "find files by pattern"
+else if (strcmp(args[0], "w24fp") == 0) {
+    file_flag = 0; // The matching paths are listed, no file transfer is expected
+    printf("Find Files By Pattern Invoked\n"); // Notify that the pattern search command has been invoked
+    // A pattern with *, ? or [ is a glob for the whole name, anything else a substring; -i ignores case
+    if (num_args != 2 && !(num_args == 3 && strcmp(args[2], "-i") == 0)) { // Check if the correct number of arguments is provided
+        fprintf(stderr, "Usage: %s pattern [-i]\n", args[0]); // If not, print the correct usage
     } else {
         command_valid_flag = 1; // If correct, set the command valid flag
     }
@@ -250,8 +526,8 @@ else if (strcmp(args[0], "w24fda") == 0) {
 
 // Handling w24ft command (get files with specific extensions)
 else if (strcmp(args[0], "w24ft") == 0) {
-    if (num_args < 1 || num_args > 4) { // Check if the number of arguments is within expected range
-        printf("Usage: %s extension1 [extension2 ... extension3]\n", args[0]); // If not, display the correct usage
+    if (num_args < 2) { // At least one extension, up to MAX_ARGS - 1 of them
+        printf("Usage: %s extension1 [extension2 ...]\n", args[0]); // If not, display the correct usage
         // Note: No command_valid_flag is set here, which  indicate missing functionality or an oversight
     }
     else
@@ -265,14 +541,11 @@ else if (strcmp(args[0], "w24ft") == 0) {
 
 // Handling dirlist command (list directory contents with options)
 else if (strcmp(args[0], "dirlist") == 0 && (strcmp(args[1], "-a") == 0 || strcmp(args[1], "-t") == 0)) {
-    write(client_socket, command, strlen(command)); // Send the 'dirlist' command to the server
-
-    // Prepare to receive the server's response
-    memset(server_reply, 0, sizeof(server_reply)); // Initialize the reply buffer
-    if (recv(client_socket, server_reply, 2000, 0) < 0) { // Attempt to receive the response
+    request_id++; // Every request gets a new id
+    // Send the 'dirlist' command to the server and print the listing it sends back
+    if (send_request(client_socket, request_id, command) < 0 || receive_reply(client_socket, request_id, 0, "temp.tar.gz", "") < 0) {
         printf("Receiving from server failed. Error\n"); // If receiving fails, notify the user
-    } else {
-        printf("%s\n", server_reply); // If successful, print the server's response
+        break; // The connection is gone
     }
 }
 
@@ -288,23 +561,20 @@ else {
 
 // If a valid command has been identified,
 if (command_valid_flag) {
-    // Send the command to the server.
-    write(client_socket, command, strlen(command));
+    // Send the command to the server as a request frame.
+    request_id++;
+    if (send_request(client_socket, request_id, command) < 0) {
+        break; // The connection is gone
+    }
 
     // If the command involves receiving a file,
     if (file_flag) {
         printf("Receiving file...\n");
-        receive_file(client_socket, unzip); // Invoke the function to handle file reception.
-    } else {
-        // If the command expects a message from the server,
-        memset(server_reply, 0, sizeof(server_reply)); // Clear the server reply buffer.
-        // Attempt to receive the server's response.
-        if (recv(client_socket, server_reply, 2000, 0) < 0) {
-            printf("Receiving from server failed. Error\n"); // Print an error message if receiving fails.
-            break; // Break from the while loop, indicating a potential issue with the connection or server.
-        }
-        printf("Server reply: %s\n", server_reply); // Print the received server reply.
-        memset(server_reply, 0, sizeof(server_reply)); // Clear the buffer again after printing.
+    }
+    // The reply says whether it is an archive or a message, read it whole before the next prompt.
+    if (receive_reply(client_socket, request_id, unzip, store ? "temp.tar" : "temp.tar.gz", "Server reply: ") < 0) {
+        printf("Receiving from server failed. Error\n"); // Print an error message if receiving fails.
+        break; // Break from the while loop, indicating a potential issue with the connection or server.
     }
 }
 }
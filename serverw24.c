@@ -7,6 +7,8 @@ Authors:
 Advanced System Programming - 2
 */
 
+#define _GNU_SOURCE // For accept4() and the other Linux specific calls used by the event loop
+
 // Standard libraries for I/O, memory allocation, and string operations
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +26,27 @@ Advanced System Programming - 2
 #include <time.h>
 #include <fcntl.h>
 #include <stdbool.h> // For using boolean types
+// Libraries for the event loop and the worker pool
+#include <sys/epoll.h> // For waiting on many sockets at once
+#include <sys/eventfd.h> // For waking the event loop when a worker finishes a job
+#include <pthread.h> // For the worker threads, build with -pthread
+#include <errno.h> // For checking EAGAIN on non-blocking sockets
+#include <signal.h> // For ignoring SIGPIPE when a client goes away mid-transfer
+#include <sys/mman.h> // For the routing statistics shared by the acceptor processes
+#include <poll.h> // For the timeouts of the mirror health checks
+#include <stdint.h> // For the fixed size fields of the frame header
+#include <stddef.h> // For offsetof() when checking the links of an index snapshot
+#include <endian.h> // For converting the 64-bit payload length to network byte order
+#include <sys/inotify.h> // For keeping the file index up to date
+#include <sys/sendfile.h> // For sending file contents without copying them through the server
+#include <sys/syscall.h> // For io_uring, which glibc has no wrappers for
+#include <linux/io_uring.h> // For stat'ing many files with one system call
+#include <fnmatch.h> // For glob patterns in w24fp
+#include <ctype.h> // For case-insensitive trigrams
+#include <zlib.h> // For compressing archives while they are sent, build with -lz
+#ifdef __SSE2__
+#include <emmintrin.h> // For comparing the end of a name with 16 suffixes at a time
+#endif
 
 // Preprocessor directives for setting constants
 #define SERVER_IP "127.0.0.1" // IP address for localhost
@@ -33,15 +56,111 @@ Advanced System Programming - 2
 #define SERVER_PORT 8082 // Port number for the server
 #define MAX_PATH_LENGTH 4096 // Maximum path length for files
 #define MAX_COMMAND_LENGTH 10000 // Maximum length for commands processed by the server
-#define MAX_ARGS 10 // Maximum number of arguments in a command
-#define MAX_CMD_LEN 2048 // Maximum length for a system command
+#define MAX_ARGS 64 // Maximum number of arguments in a command, w24ft takes one per extension
+#define SUFFIX_BLOCK 16 // Longest suffix the suffix kernel handles, longer ones are compared the plain way
+#define SUFFIX_LANES 16 // Suffixes the suffix kernel compares with a name at once, one per byte of a register
+#define SUFFIX_GROUPS ((MAX_ARGS + SUFFIX_LANES - 1) / SUFFIX_LANES) // Most groups of suffixes a query can have
+#define MAX_EVENTS 64 // Max number of events returned by a single epoll_wait call
+#define WORKER_THREADS 4 // Number of threads that run the heavy commands
+#define CLIENT_MESSAGE_SIZE 2000 // Size of the per-connection command buffer
+#define MAX_ACCEPTORS 64 // Upper limit for the number of pre-forked acceptor processes
+#define MAX_BACKENDS 16 // Most mirrors a main server can route to
+#define MAX_SERVERS (MAX_BACKENDS + 1) // This server plus its mirrors
+#define MAX_CONFIG_LINE 256 // Longest line accepted in the config file
+#define INITIAL_LATENCY_US 1000 // Latency assumed for a server before it has served anything
+#define LATENCY_EWMA_SHIFT 3 // Each new latency sample moves the average by 1/8
+#define RELAY_CHUNK 65536 // Most bytes moved by one splice() call, the default pipe capacity
+#define MIRROR_POOL_SIZE 4 // Warm connections each acceptor keeps open to every mirror
+#define DRAIN_TIMEOUT_MS 5000 // A mirror connection still busy with a departed client's commands after this is closed
+#define MUX_LINKS 2 // Connections each acceptor shares between the framed clients it relays to a mirror
+#define MUX_BACKLOG_MAX (1 << 20) // Most reply bytes from a shared mirror connection a client may leave untaken before it is dropped
+#define HEALTH_INTERVAL_MS 2000 // Time between two rounds of mirror health checks
+#define HEALTH_TIMEOUT_MS 1000 // A mirror that takes longer to answer a ping has failed the check
+#define HEALTH_FAILURES_DOWN 2 // Failed checks in a row before a mirror is taken out of the rotation
+#define DEGRADED_QUEUE_DEPTH 8 // A mirror with this many commands queued or running is degraded
+#define DEGRADED_PROBE_US 250000 // A mirror that takes longer to answer a ping is degraded
+#define DEGRADED_PENALTY 4 // Degraded mirrors look this many times more expensive to the routing
+
+// Framed protocol: a message that starts with FRAME_MAGIC is a header followed by its payload, anything
+// else is a plain text command line. A client that sends frames gets exactly one frame back per request,
+// so many replies, archives included, can follow each other on one long-lived connection. An archive whose
+// size is not known when it starts is sent as FRAME_ARCHIVE_PART frames back to back, the empty one ends it.
+#define FRAME_MAGIC 0xF7 // First byte of every frame, never the start of a text command
+#define FRAME_HEADER_SIZE 16 // sizeof(frame_header_t)
+#define MAX_FRAME_COMMAND (CLIENT_MESSAGE_SIZE - FRAME_HEADER_SIZE) // Longest command a request frame may carry
+#define INDEX_NONE UINT32_MAX // No entry: parent of the root, end of a child list, unused watch
+#define INDEX_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define INOTIFY_BUFFER_SIZE 65536 // Bytes of inotify events read at once
+#define INDEX_INITIAL_ENTRIES 4096 // First allocation of the index table, doubled as needed
+#define INDEX_INITIAL_NAMES 65536 // First allocation of the index string pool, doubled as needed
+#define INDEX_INITIAL_NAME_SLOTS 4096 // First size of the name and extension hash tables, doubled once 3/4 full
+#define WALK_MAX_THREADS 16 // Most threads walking the tree while the index is built
+#define WALK_MAX_OPEN 512 // Directories the walk keeps open ahead of time, the others are opened by path later
+#define WALK_BUFFER_SIZE 65536 // Bytes of directory entries read by one getdents64() call
+#define WALK_STAT_BATCH 512 // Names of a directory stat'ed together
+#define STAT_RING_ENTRIES 256 // statx requests in flight on one io_uring
+#define STAT_PROBE 16 // Names of a batch stat'ed one by one to find out whether the batch is worth io_uring
+#define STAT_CACHED_US 10 // A statx() quicker than this on average was answered from the cache, not the disk
+#define STAT_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_BTIME) // What the index needs
+#define TRIGRAM_MAX_UNINDEXED 65536 // Bytes of names added after the trigram index was built before it is rebuilt
+#define MAX_PATTERN_TRIGRAMS 64 // Trigrams of a pattern looked up, more would rarely narrow the search further
+#define MAX_PATTERN_MATCHES 1000 // Files listed by one w24fp, the rest are only counted
+#define INDEX_MAX_CHANGED 4096 // Files changed since the columns were sorted before they are sorted again
+#define INDEX_CHANGED 0x1 // Entry flag: added or updated since the columns were sorted
+#define INDEX_SNAPSHOT_MAGIC "W24INDEX" // First bytes of an index snapshot file
+#define INDEX_SNAPSHOT_VERSION 4 // Bumped whenever the layout of the snapshot or of index_entry_t changes
+#define INDEX_SNAPSHOT_ALIGN 128 // The entries of a snapshot start at a multiple of this offset
+#define INDEX_REFRESH_BATCH 256 // Files checked per hold of the index lock when they are compared with the disk
+#define COMPRESS_BLOCK 131072 // Bytes of an archive compressed as one piece by a compression thread
+#define COMPRESS_BOUND (COMPRESS_BLOCK + COMPRESS_BLOCK / 1024 + 64) // Most compressed bytes a block can turn into
+#define COMPRESS_WINDOW 32768 // Bytes before a block that its compression can refer back to, the deflate window
+#define COMPRESS_MAX_THREADS 32 // Upper limit for the compression threads of an acceptor
+#define COMPRESS_MAX_BLOCKS 8 // Most blocks of one archive being compressed or waiting to be sent
+#define TAR_BLOCK 512 // Tar headers and file contents take whole blocks of this size
+#define SENDFILE_MIN 65536 // Smaller files of a stored archive are copied in with the headers, sent many at once
+#define ARCHIVE_CACHE_BYTES (128 << 20) // Archives kept for repeated queries, split evenly between the acceptors
+#define ARCHIVE_CACHE_ENTRY_MAX (32 << 20) // Larger archives are not cached, nor those above an acceptor's share
+#define RAW_MIN 65536 // Smallest file checked for content that deflate can't shrink, smaller ones are compressed anyway
+#define ENTROPY_SAMPLE 4096 // Bytes at the start of a file looked at to tell whether it can be compressed
+#define MAX_PIPELINED 64 // Commands of one connection that may be queued or running at the same time
+#define SEND_TIMEOUT_MS 10000 // A client that takes none of its reply for this long is dropped
+
+enum { FRAME_REQUEST = 1, FRAME_TEXT, FRAME_ARCHIVE, FRAME_ARCHIVE_PART };
+enum { STATUS_OK, STATUS_NOT_FOUND, STATUS_ERROR, STATUS_BAD_REQUEST };
+
+// Header of a frame, multi-byte fields are in network byte order
+typedef struct {
+    uint8_t magic; // FRAME_MAGIC
+    uint8_t type; // FRAME_REQUEST from the client, FRAME_TEXT, FRAME_ARCHIVE or FRAME_ARCHIVE_PART from the server
+    uint8_t status; // STATUS_OK or why the request failed, 0 in requests
+    uint8_t reserved; // Always 0
+    uint32_t request_id; // Chosen by the client and copied into the reply
+    uint64_t length; // Number of payload bytes after the header
+} frame_header_t;
+_Static_assert(sizeof(frame_header_t) == FRAME_HEADER_SIZE, "frame header must not be padded");
+
+// Where the output of a command goes. Text commands write straight to the socket, a framed request has its
+// text collected and sent as one frame at the end, or its archive sent as one frame of known size.
+// Framed requests of one connection run concurrently, so their frames are written under the connection's lock.
+typedef struct {
+    int fd; // Client socket, always non-blocking, send_all() waits for room up to SEND_TIMEOUT_MS
+    bool framed; // The request was a frame, so the reply has to be one
+    pthread_mutex_t *write_lock; // Keeps the frames of concurrent requests from interleaving
+    uint32_t request_id; // Id of the framed request
+    int status; // STATUS_OK unless a handler reported a failure
+    bool sent; // The framed reply has already gone out
+    char *text; // Text collected for the framed reply
+    size_t length; // Bytes in text
+    size_t capacity; // Allocated size of text
+} reply_t;
 
 // Global variable declarations
 FILE *fp; // File pointer for file operations
 char fileBuffer[1024] = {0}; // Buffer for file data, initialized to zeros
 
-void crequest(int client_socket);
-int send_file(int socketFd, const char *fp); // Correct the return type to match the definition
+int crequest(reply_t *reply, const char *client_message);
+long job_queue_depth(void);
+long now_us(void);
 
 // Define a structure for storing directory information
 typedef struct {
@@ -49,179 +168,256 @@ typedef struct {
     time_t creation_time; // Creation time of the directory
 } dir_info_t;
 
+__thread int send_timeout_ms = SEND_TIMEOUT_MS; // How long a write waits for the client, 0 on the event loop
+
+// Waits until a client socket has room for more data. A client that doesn't make room in time is shut down, so
+// the replies of its other requests fail at once instead of each waiting out the timeout again.
+int wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, send_timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) {
+        shutdown(fd, SHUT_RDWR);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+// Sends the whole buffer on a non-blocking socket, returns -1 if the client is gone or stopped reading
+int send_all(int fd, const void *data, size_t length, int flags) {
+    const char *next = data;
+    while (length > 0) {
+        ssize_t sent = send(fd, next, length, flags);
+        if (sent >= 0) {
+            next += sent;
+            length -= sent;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (wait_writable(fd) < 0) {
+                return -1;
+            }
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Sends a frame header, returns -1 if the client is gone
+int send_frame_header(int fd, int type, int status, uint32_t request_id, uint64_t length) {
+    frame_header_t header = {
+        .magic = FRAME_MAGIC,
+        .type = type,
+        .status = status,
+        .request_id = htonl(request_id),
+        .length = htobe64(length),
+    };
+    return send_all(fd, &header, sizeof(header), MSG_MORE);
+}
+
+// Sends part of a command's output: directly in text mode, into the reply buffer for a framed request.
+// Text goes out under the connection's lock too, so it can never land inside another request's frame.
+int reply_send(reply_t *reply, const void *data, size_t length) {
+    if (!reply->framed) {
+        pthread_mutex_lock(reply->write_lock);
+        int result = send_all(reply->fd, data, length, 0);
+        pthread_mutex_unlock(reply->write_lock);
+        return result < 0 ? -1 : (int)length;
+    }
+    if (reply->sent) {
+        return -1; // Only one frame per request, an archive has already been sent
+    }
+    if (reply->length + length > reply->capacity) {
+        size_t capacity = reply->capacity ? reply->capacity : BUFFER_SIZE;
+        while (capacity < reply->length + length) {
+            capacity *= 2;
+        }
+        char *text = realloc(reply->text, capacity);
+        if (text == NULL) {
+            return -1;
+        }
+        reply->text = text;
+        reply->capacity = capacity;
+    }
+    memcpy(reply->text + reply->length, data, length);
+    reply->length += length;
+    return length;
+}
+
+// Sends the collected text of a framed request as its reply, unless an archive went out already
+void reply_finish(reply_t *reply) {
+    if (reply->framed && !reply->sent) {
+        pthread_mutex_lock(reply->write_lock);
+        if (send_frame_header(reply->fd, FRAME_TEXT, reply->status, reply->request_id, reply->length) < 0 ||
+            send_all(reply->fd, reply->text, reply->length, 0) < 0) {
+            perror("Error: Failed to send reply");
+        }
+        pthread_mutex_unlock(reply->write_lock);
+        reply->sent = true;
+    }
+    free(reply->text);
+    reply->text = NULL;
+}
+
 // Function to send detailed information about a file over a network socket
-void send_file_info(int socket, const char *path, const char *filename, const struct stat *file_stat) {
+void send_file_info(reply_t *reply, const char *path, const char *filename, const struct stat *file_stat) {
     // Buffer for constructing the message to be sent
     char message[1024];
+    char time_buffer[32]; // ctime_r output, since several workers may format times at once
     
     // Prepare a message with detailed file information
     // Includes the file's path, name, size, creation time, and permissions
     int message_length = snprintf(message, sizeof(message),
                                   "\nFile Path:%s\nFilename: %s\nFile Size: %ld\nCreate At: %s\nPermissions: %o\n",
-                                  path, filename, file_stat->st_size, ctime(&file_stat->st_mtime), file_stat->st_mode & 0777);
+                                  path, filename, file_stat->st_size, ctime_r(&file_stat->st_mtime, time_buffer), file_stat->st_mode & 0777);
 
     // Send the prepared message to the specified socket
     // Check if the sending fails
-    if (send(socket, message, message_length, 0) < 0) {
+    if (reply_send(reply, message, message_length) < 0) {
         perror("send failed"); // Print an error message to stderr
-        exit(EXIT_FAILURE); // Terminate the program with a failure status
     }
 }
 
-// Recursively searches for a file in the given directory and subdirectories.
-void find_and_send_file(int client_socket, const char *filename, const char *directory, int *found) {
-    // Open the directory specified by 'directory' parameter.
-    DIR *dir = opendir(directory);
-    if (!dir) {
-        // If opening directory fails, print error message and exit function.
-        perror("Failed to open directory");
+// io_uring used to stat files in batches: statx requests for a whole directory are queued at once and their
+// completions handled in whatever order they finish, instead of one blocking stat() after the other. Where
+// io_uring is not available (old kernel, disabled by sysctl or seccomp) statx() is called for each file.
+typedef struct {
+    int fd; // The ring, -1 if io_uring is not available
+    unsigned entries; // Size of the submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} stat_ring_t;
+
+void stat_ring_init(stat_ring_t *ring) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, STAT_RING_ENTRIES, &params);
+    if (fd < 0) {
         return;
     }
 
-    struct dirent *dp;
-    char buffer[BUFFER_SIZE];
-    struct stat st;
-
-    // Iterate over each entry in the directory.
-    while ((dp = readdir(dir)) != NULL && !*found) {
-        // Skip over '.' and '..' entries to avoid infinite loops.
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
-            continue;
-        }
-
-        // Construct full path for current entry.
-        snprintf(buffer, sizeof(buffer), "%s/%s", directory, dp->d_name);
-
-        if (dp->d_type == DT_DIR) {
-            // If entry is a directory, search it recursively for the file.
-            find_and_send_file(client_socket, filename, buffer, found);
-        } else if (dp->d_type == DT_REG && strcmp(dp->d_name, filename) == 0) {
-            // If entry is a regular file and names match, retrieve file details.
-            if (stat(buffer, &st) == 0) {
-                // Send file information through the socket.
-                send_file_info(client_socket, directory, filename, &st);
-                *found = 1; // Indicate that the file has been found.
-            }
-        }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(fd);
+        return;
     }
 
-    // Close the directory.
-    closedir(dir);
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->fd = fd;
 }
 
-void findfile(int client_socket, char *filename, char *path, int *found) {
-    // Calls the 'find_and_send_file' function to attempt to locate and send the file.
-    find_and_send_file(client_socket, filename, path, found);
-
-    // If the file was not found ('found' flag is false), send a "file not found" message to the client.
-    if (!*found) {
-        char message[] = "File not found\n";
-        // Send the "file not found" message to the client through the socket.
-        send(client_socket, message, sizeof(message) - 1, 0);
+void stat_ring_free(stat_ring_t *ring) {
+    if (ring->fd != -1) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        ring->fd = -1;
     }
 }
 
-void sgetfiles(const char *dir_path, const char *tar_path, const char *size1, const char *size2, int client_socket) {
-    // Creates a unique temporary file path to store the list of files meeting the criteria.
-    char temp_file_list_path[] = "/tmp/filelistXXXXXX";
-    // Creates the temporary file and returns a file descriptor to it.
-    int temp_fd = mkstemp(temp_file_list_path);
-    if (temp_fd == -1) {
-        // If creating the temporary file fails, sends an error message to the client.
-        perror("Failed to create temporary file");
-        send(client_socket, "Server error: could not generate file list.\n", 45, 0);
-        return;
-    }
-
-    // Prepares a command string to find files within specified size range and outputs to the temporary file.
-    char find_cmd[MAX_CMD_LEN];
-    int res = snprintf(find_cmd, MAX_CMD_LEN, "find %s -type f -size +%s -size -%s > %s",
-                       dir_path, size1, size2, temp_file_list_path);
-    // Checks if the command string was truncated or if there was an error creating it.
-    if (res >= MAX_CMD_LEN || res < 0) {
-        fprintf(stderr, "Error constructing find command.\n");
-        // Closes and deletes the temporary file before exiting.
-        close(temp_fd);
-        unlink(temp_file_list_path);
-        return;
+// The io_uring of a worker thread, set up the first time it gets a batch worth it and kept for the next ones
+stat_ring_t *thread_stat_ring(void) {
+    static __thread stat_ring_t ring;
+    static __thread bool ready = false;
+    if (!ready) {
+        stat_ring_init(&ring);
+        ready = true;
     }
+    return &ring;
+}
 
-    // Executes the 'find' command. If it fails (non-zero return value), sends a "No file found" message.
-    int find_result = system(find_cmd);
-    if (find_result != 0) {
-        const char* message = "No file found\n";
-        send(client_socket, message, strlen(message), 0);
-        // Closes and deletes the temporary file before exiting.
-        close(temp_fd);
-        unlink(temp_file_list_path);
-        return;
+// Stats count names relative to a directory, like fstatat(). status[i] is 0 when results[i] was filled in,
+// -errno otherwise. A NULL ring stands for the calling thread's own.
+// io_uring only pays off when the inodes have to be read from the disk, on a warm cache it is slower than one
+// statx() after the other. So the first names are stat'ed directly, and the ring takes the rest only if those
+// had to wait. Small batches never touch the ring.
+void stat_batch(stat_ring_t *ring, int directory_fd, char **names, int count, int flags, struct statx *results, int *status) {
+    int probed = 0;
+    long start_us = now_us();
+    for (; probed < count && probed < STAT_PROBE; probed++) {
+        status[probed] = statx(directory_fd, names[probed], flags, STAT_MASK, &results[probed]) == 0 ? 0 : -errno;
     }
-
-    // Prepares a command string to create a tar archive of the files listed in the temporary file.
-    char tar_cmd[MAX_CMD_LEN];
-    snprintf(tar_cmd, MAX_CMD_LEN, "tar -czf %s -T %s", tar_path, temp_file_list_path);
-    // Executes the 'tar' command. If it fails, sends an error message.
-    int tar_result = system(tar_cmd);
-    if (tar_result != 0) {
-        fprintf(stderr, "Failed to create tar archive.\n");
-        const char* message = "Error creating file archive\n";
-        send(client_socket, message, strlen(message), 0);
-    } else {
-        // If the tar archive is successfully created, sends it to the client.
-        send_file(client_socket, tar_path);
+    bool use_ring = probed < count && now_us() - start_us >= (long)probed * STAT_CACHED_US;
+    if (use_ring && ring == NULL) {
+        ring = thread_stat_ring();
     }
+    use_ring = use_ring && ring->fd != -1;
 
-    // Closes the temporary file and deletes it to clean up.
-    close(temp_fd);
-    unlink(temp_file_list_path);
-}
-
-// Defines a function to search for files modified before a specified date and send a tar archive of those files.
-void dgetfiles_before(const char *dir_path, const char *tar_path, const char *date, int client_socket) {
-    // Buffer to store the command to find files modified before a specific date.
-    char find_cmd[MAX_CMD_LEN];
-    // Buffer to store the command to archive the found files.
-    char tar_cmd[MAX_CMD_LEN];
+    int submitted = probed, completed = probed;
+    while (use_ring && ring->fd != -1 && completed < count) {
+        // Queue what the ring has room for
+        unsigned tail = *ring->sq_tail;
+        unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        while (submitted < count && submitted - completed < (int)ring->entries && tail - head < ring->entries) {
+            unsigned index = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = directory_fd;
+            sqe->addr = (uintptr_t)names[submitted];
+            sqe->len = STAT_MASK;
+            sqe->off = (uintptr_t)&results[submitted];
+            sqe->statx_flags = flags;
+            sqe->user_data = submitted;
+            ring->sq_array[index] = index;
+            tail++;
+            submitted++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
 
-    // Fills 'find_cmd' with the command to find files in 'dir_path' modified before 'date'.
-    snprintf(find_cmd, MAX_CMD_LEN, "find %s -type f ! -newermt '%s'", dir_path, date);
+        // Hand them to the kernel and wait for at least one to finish
+        unsigned to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("Error: io_uring failed, stat'ing files one by one");
+            stat_ring_free(ring);
+            break;
+        }
 
-    // Executes the 'find' command. If files are found (exit status 0), it proceeds; otherwise, it sends a message.
-    if (system(find_cmd) == 0) {
-        // Constructs the command to create a tar archive of the found files, storing the archive in 'tar_path'.
-        snprintf(tar_cmd, MAX_CMD_LEN, "%s | xargs tar -czf %s", find_cmd, tar_path);
-        // Executes the command to create the tar archive.
-        system(tar_cmd);
-        // Sends the tar archive file to the client over the socket.
-        send_file(client_socket, tar_path);
-    } else {
-        // If no files matching the criteria are found, sends a "No file found" message to the client.
-        const char* message = "No file found\n";
-        send(client_socket, message, strlen(message), 0);
+        unsigned cq_head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; cq_head != cq_tail; cq_head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[cq_head & *ring->cq_mask];
+            status[cqe->user_data] = cqe->res;
+            if (cqe->res == -EINVAL) {
+                status[cqe->user_data] = 1; // Kernel without IORING_OP_STATX, done below
+            }
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
     }
-}
-
-void dgetfiles_after(const char *dir_path, const char *tar_path, const char *date, int client_socket) {
-    char find_cmd[MAX_CMD_LEN]; // Buffer to hold the find command
-    char tar_cmd[MAX_CMD_LEN]; // Buffer to hold the tar command
 
-    // Prepare the find command to search for files newer than a specific date
-    snprintf(find_cmd, MAX_CMD_LEN, "find %s -type f -newermt '%s'", dir_path, date);
-
-    // Execute the find command using system() call
-    // system() returns 0 if the command executed successfully
-    if (system(find_cmd) == 0) {
-        // If the find command succeeds, prepare the tar command to archive the found files
-        snprintf(tar_cmd, MAX_CMD_LEN, "%s | xargs tar -czf %s", find_cmd, tar_path);
-        // Execute the tar command using system() call
-        system(tar_cmd);
-        // Send the tar file to the client
-        send_file(client_socket, tar_path);
-    } else {
-        // If no files were found (or if the find command failed for any other reason),
-        // send a "No file found" message to the client
-        const char* message = "No file found\n";
-        send(client_socket, message, strlen(message), 0);
+    // On a warm cache, without io_uring, and for whatever it could not do
+    for (int i = probed; i < count; i++) {
+        if (!use_ring || ring->fd == -1 || status[i] == 1) {
+            status[i] = statx(directory_fd, names[i], flags, STAT_MASK, &results[i]) == 0 ? 0 : -errno;
+        }
     }
 }
 
@@ -240,12 +436,14 @@ int compare_dir_info(const void *a, const void *b) {
     return (dirA->creation_time > dirB->creation_time) - (dirA->creation_time < dirB->creation_time);
 }
 
-void list_subdirectories_by_time(int client_socket) {
+void list_subdirectories_by_time(reply_t *reply) {
     DIR *d; // Directory stream
     struct dirent *dir; // Pointer for directory entry
-    struct stat st; // Used to get information about the file
     char *homeDir = getenv("HOME"); // Get the path to the home directory
     dir_info_t directories[MAX_CLIENTS]; // Array to store directory info, adjust size as needed
+    char *names[MAX_CLIENTS]; // Names to stat, in directories
+    struct statx results[MAX_CLIENTS]; // What stat_batch() found
+    int status[MAX_CLIENTS]; // 0 for the names it could stat
     int count = 0; // Counter for directories found
 
     // Open the home directory
@@ -255,20 +453,27 @@ void list_subdirectories_by_time(int client_socket) {
         while ((dir = readdir(d)) != NULL && count < MAX_CLIENTS) {
             // Check if the entry is a directory and not '.' or '..'
             if (dir->d_type == DT_DIR && strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) {
-                char fullPath[MAX_PATH_LENGTH];
-                // Construct full path of the directory
-                snprintf(fullPath, sizeof(fullPath), "%s/%s", homeDir, dir->d_name);
-                // Get file status
-                if (stat(fullPath, &st) == 0) {
-                    // Store the directory name and creation time if stat call is successful
-                    strcpy(directories[count].name, dir->d_name);
-                    directories[count].creation_time = st.st_ctime; // Store creation time
-                    count++; // Increment counter
-                }
+                snprintf(directories[count].name, sizeof(directories[count].name), "%s", dir->d_name);
+                names[count] = directories[count].name;
+                count++; // Increment counter
             }
         }
+
+        // Stat them all in one batch, on this thread's ring if the batch needs one
+        stat_batch(NULL, dirfd(d), names, count, 0, results, status);
         closedir(d); // Close directory stream
 
+        // Keep the directories that could be stat'ed, with their creation time when the filesystem records it
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (status[i] == 0) {
+                directories[kept] = directories[i];
+                directories[kept].creation_time = (results[i].stx_mask & STATX_BTIME) ? results[i].stx_btime.tv_sec : results[i].stx_ctime.tv_sec;
+                kept++;
+            }
+        }
+        count = kept;
+
         // Sort the directories array based on creation time using qsort
         qsort(directories, count, sizeof(dir_info_t), compare_dir_info);
 
@@ -285,101 +490,13 @@ void list_subdirectories_by_time(int client_socket) {
         }
 
         // Send the sorted list to the client
-        send(client_socket, sortedDirectories, strlen(sortedDirectories), 0);
+        reply_send(reply, sortedDirectories, strlen(sortedDirectories));
     } else {
         // Send error message to client if home directory cannot be opened
         char *errorMsg = "Failed to open home directory.\n";
-        send(client_socket, errorMsg, strlen(errorMsg), 0);
-    }
-}
-
-// This function checks if the provided filename has an extension that matches any of the extensions in the given list.
-bool has_valid_extension(const char *filename, const char **extensions, int num_extensions) {
-    // Iterate over each extension in the list
-    for (int i = 0; i < num_extensions; i++) {
-        const char *extension = extensions[i]; // Current extension to check against
-        size_t filename_len = strlen(filename); // Length of the filename
-        size_t extension_len = strlen(extension); // Length of the current extension
-
-        // Ensure the filename is longer than the extension to avoid out-of-bounds errors
-        if (filename_len > extension_len) {
-            // Check if the end of the filename matches the extension
-            // This is done by comparing the substring of the filename that should match the extension
-            if (strcmp(filename + filename_len - extension_len, extension) == 0) {
-                return true; // If a match is found, return true
-            }
-        }
-    }
-    return false; // If no matching extension is found after checking all, return false
-}
-
-void search_and_add_files_to_temp(const char *root_path, const char **extensions, int num_extensions, FILE *tempFile) {
-    DIR *dir = opendir(root_path); // Attempt to open the directory specified by root_path
-    if (!dir) {
-        perror("Failed to open directory"); // If opening the directory fails, print an error message
-        return; // Exit the function
-    }
-
-    struct dirent *dir_entry; // Structure to hold information about each directory entry
-    char file_path[MAX_PATH_LENGTH]; // Buffer to hold the full path of each file
-
-    while ((dir_entry = readdir(dir)) != NULL) { // Read each entry in the directory
-        // Skip "." and ".." entries to avoid infinite recursion
-        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) continue;
-
-        // Construct the full path of the current entry
-        snprintf(file_path, sizeof(file_path), "%s/%s", root_path, dir_entry->d_name);
-
-        if (dir_entry->d_type == DT_DIR) {
-            // If the entry is a directory, call the function recursively to handle subdirectories
-            search_and_add_files_to_temp(file_path, extensions, num_extensions, tempFile);
-        } else if (dir_entry->d_type == DT_REG) {
-            // If the entry is a regular file, check if it matches any of the specified extensions
-            if (has_valid_extension(dir_entry->d_name, extensions, num_extensions)) {
-                // If the file matches, write its full path to the temporary file
-                fprintf(tempFile, "%s\n", file_path);
-            }
-        }
+        reply->status = STATUS_ERROR;
+        reply_send(reply, errorMsg, strlen(errorMsg));
     }
-
-    closedir(dir); // Close the directory after processing all entries
-}
-
-void generate_tar_gz_from_files_with_extensions(const char *tar_filename, const char **extensions, int num_extensions) {
-    // Create a temporary file to hold the list of file paths. This file will be used to specify which files should be included in the tar archive.
-    char tempFileTemplate[] = "/tmp/tempfilelistXXXXXX";
-    int tempFd = mkstemp(tempFileTemplate); // Creates a unique temporary file and opens it. The XXXXXX will be replaced with a unique string.
-    if (tempFd < 0) {
-        perror("Unable to create temporary file"); // If creating the temporary file fails, print an error message.
-        return; // Exit the function if unable to create the temporary file.
-    }
-
-    FILE *tempFile = fdopen(tempFd, "w"); // Open the file descriptor returned by mkstemp as a FILE* to allow writing with standard I/O functions.
-    if (tempFile == NULL) {
-        perror("Failed to open temporary file"); // If opening the file fails, print an error message.
-        close(tempFd); // Close the file descriptor to clean up resources.
-        return; // Exit the function if unable to open the file.
-    }
-
-    // Search for files that match the given extensions and add their paths to the temporary file.
-    // The search starts from the user's HOME directory.
-    const char *root_path = getenv("HOME"); 
-    search_and_add_files_to_temp(root_path, extensions, num_extensions, tempFile);
-
-    fclose(tempFile); // Close the FILE* to ensure all data is written to disk.
-
-    // Construct the tar command that uses the list of file paths stored in the temporary file to create a tar.gz archive.
-    char command[MAX_COMMAND_LENGTH];
-    snprintf(command, sizeof(command), "tar -czf %s -T %s", tar_filename, tempFileTemplate); // -T option tells tar to read the list of files from the specified file.
-    
-    int result = system(command); // Execute the tar command.
-    if (result != 0) {
-        fprintf(stderr, "Failed to create tar.gz archive\n"); // If the tar command fails, print an error message.
-    } else {
-        printf("Archive created successfully\n"); // If the tar command succeeds, print a success message.
-    }
-
-    unlink(tempFileTemplate); // Delete the temporary file to clean up.
 }
 
 // Comparison function for use with sorting routines like qsort. It compares two strings.
@@ -402,7 +519,7 @@ int cmpstr(const void *a, const void *b) {
 
 
 // list_subdirectories function
-void list_subdirectories(int client_socket) {
+void list_subdirectories(reply_t *reply) {
     DIR *d;
     struct dirent *dir;
     char *homeDir = getenv("HOME");
@@ -431,476 +548,4979 @@ void list_subdirectories(int client_socket) {
         }
 
         // Send the sorted list to the client
-        send(client_socket, sortedDirectories, strlen(sortedDirectories), 0);
+        reply_send(reply, sortedDirectories, strlen(sortedDirectories));
     } else {
         char *errorMsg = "Failed to open home directory.\n";
-        send(client_socket, errorMsg, strlen(errorMsg), 0);
+        reply->status = STATUS_ERROR;
+        reply_send(reply, errorMsg, strlen(errorMsg));
     }
 }
 
-// Sends a file over a socket
-int send_file(int socketFd, const char *fp) {
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("Failed to fork");
-        return -1; // Return error indicator
-    }
+// In-memory index of the home directory. Every file and directory is one entry of a flat table, paths are
+// rebuilt from the parent links and the names live in one string pool. The w24 queries scan this table instead
+// of walking the tree. It is built before the acceptors are forked, so they all share it copy-on-write.
+// Entries of removed files stay in the table with mode 0.
+// Names are interned: each distinct name is stored once and found through a hash table, which also links
+// all the entries of a name together so w24fn never scans the table. A second hash table does the same for
+// extensions, so w24ft reads the files of each extension it asks for and nothing else.
+typedef struct {
+    uint32_t parent; // Entry of the directory holding this one, INDEX_NONE for the root
+    uint32_t name; // Offset of the name in the string pool
+    uint16_t name_length; // Length of the name
+    uint16_t extension; // Offset of the extension in the name (just after the last '.'), 0 if it has none
+    mode_t mode; // File type and permissions, 0 once the file is removed
+    uint32_t first_child; // First entry of a directory, INDEX_NONE if empty
+    uint32_t next_sibling; // Next entry of the same directory
+    uint32_t next_same_name; // Next entry with the same name, INDEX_NONE for the last one
+    uint32_t next_same_extension; // Next entry with the same extension, INDEX_NONE for the last one
+    uint32_t flags; // INDEX_CHANGED
+    off_t size; // Size in bytes
+    time_t mtime; // Last modification
+    time_t ctime; // Last status change
+} index_entry_t;
 
-    if (pid == 0) {
-        // Child process: responsible for sending the file
-        int filefd = open(fp, O_RDONLY);
-        if (filefd < 0) {
-            perror("Failed to open file");
-            exit(EXIT_FAILURE);
-        }
+// Slot of a name or extension hash table, open addressing with linear probing
+typedef struct {
+    uint32_t name; // Offset of the string in the string pool, INDEX_NONE if the slot is free. An extension
+                   // points into the name of the first entry that has it.
+    uint32_t hash; // Hash of the string, kept so the table can grow without rehashing the strings
+    uint32_t first; // First entry with this string, in the order they were added
+    uint32_t last; // Last entry with this string, new ones are linked after it
+} name_slot_t;
 
-        char buffer[BUFFER_SIZE];
-        ssize_t bytesRead;
-        while ((bytesRead = read(filefd, buffer, sizeof(buffer))) > 0) {
-            if (send(socketFd, buffer, bytesRead, 0) < 0) {
-                perror("Failed to send data");
-                close(filefd);
-                exit(EXIT_FAILURE);
-            }
-        }
+typedef struct {
+    name_slot_t *slots;
+    uint32_t slot_count; // A power of two
+    uint32_t used; // Slots holding a string
+} name_table_t;
 
-        if (bytesRead < 0) {
-            perror("Failed to read file");
-        }
+// Column of the regular files sorted by one of their fields, struct of arrays so a range is found with two
+// binary searches over keys and read as one contiguous run of rows
+enum { COLUMN_SIZE, COLUMN_MTIME, INDEX_COLUMNS };
+typedef struct {
+    int64_t *keys; // Sorted field values
+    uint32_t *rows; // Entry of each key
+    uint32_t length; // Files in the column
+} index_column_t;
 
-        close(filefd);
-        close(socketFd); // Ensure the socket is closed in the child process
-        fprintf(stderr, "File %s sent successfully to client\n", fp);
-        exit(EXIT_SUCCESS); // Terminate the child process successfully
-    } else {
-        // Parent process waits for the child to complete
-        int status;
-        waitpid(pid, &status, 0);
-        if (status != 0) {
-            fprintf(stderr, "Failed to send file %s to client\n", fp);
-            return -1; // Indicate failure
-        }
-        return 0; // Success indicator
+typedef struct {
+    index_entry_t *entries; // The table, entry 0 is the home directory itself
+    uint32_t count; // Entries in use
+    uint32_t removed; // Entries of files that no longer exist
+    uint32_t capacity; // Entries allocated
+    char *names; // String pool, every name is null-terminated
+    size_t names_length; // Bytes of the pool in use
+    size_t names_capacity; // Bytes of the pool allocated
+    name_table_t name_table; // The distinct names
+    name_table_t extension_table; // The distinct extensions
+    // The columns are sorted when a range query first needs them. Files changed after that are listed in
+    // changed and checked one by one, until there are too many and the columns are sorted again.
+    index_column_t columns[INDEX_COLUMNS];
+    bool columns_ready; // The columns are sorted and changed lists what they miss
+    uint32_t *changed; // Entries flagged INDEX_CHANGED
+    uint32_t changed_count;
+    uint32_t changed_capacity;
+    pthread_mutex_t columns_lock; // Queries sort the columns while holding only the read lock
+    // Trigram index of the distinct names, built by the first pattern search. A name is known by its offset in
+    // the string pool. Names added to the pool later are checked one by one until there are enough of them
+    // to build it again.
+    uint32_t *trigram_keys; // Distinct trigrams of the names, lowercase, sorted
+    uint32_t *trigram_offsets; // Postings of trigram_keys[i] are trigram_postings[offsets[i]] to [offsets[i + 1]]
+    uint32_t *trigram_postings; // Names holding each trigram, sorted
+    uint32_t trigram_count; // Distinct trigrams
+    size_t trigram_names_length; // Bytes of the pool covered by the trigram index
+    bool trigrams_ready;
+    pthread_mutex_t trigrams_lock; // The trigram index is built while holding only the read lock
+    char *snapshot; // Mapping of the snapshot the index was loaded from, NULL if it was built by walking
+    size_t snapshot_size; // Bytes mapped
+    pthread_rwlock_t lock; // Queries read the index while it may be updated
+} file_index_t;
+
+file_index_t file_index = {.lock = PTHREAD_RWLOCK_INITIALIZER, .columns_lock = PTHREAD_MUTEX_INITIALIZER,
+                           .trigrams_lock = PTHREAD_MUTEX_INITIALIZER};
+char index_snapshot_path[MAX_PATH_LENGTH]; // Where the index is saved between runs, a name under /tmp if not set
+
+// Header of an index snapshot file. The entries follow at entries_offset, then the string pool and the name
+// and extension hash tables, so a snapshot is mapped and used as it is. Every process serving the same tree
+// maps the same file, so they share its pages in the page cache until one of them changes an entry.
+typedef struct {
+    char magic[8]; // INDEX_SNAPSHOT_MAGIC, not null-terminated
+    uint32_t version; // INDEX_SNAPSHOT_VERSION
+    uint32_t entry_size; // sizeof(index_entry_t) of the server that wrote it
+    uint32_t count; // Entries in the snapshot
+    uint32_t removed; // Entries of files that no longer exist
+    uint64_t names_length; // Bytes of the string pool
+    uint64_t entries_offset; // Offset of the first entry
+    uint64_t name_slots_offset; // Offset of the name hash table, just after the string pool
+    uint32_t name_slot_count; // Slots in the name hash table
+    uint32_t distinct_names; // Slots in use
+    uint64_t extension_slots_offset; // Offset of the extension hash table, just after the name hash table
+    uint32_t extension_slot_count; // Slots in the extension hash table
+    uint32_t distinct_extensions; // Slots in use
+} index_snapshot_header_t;
+
+// Drops the sorted columns, the next range query sorts them again
+void index_reset_columns(void) {
+    for (uint32_t i = 0; i < file_index.changed_count; i++) {
+        file_index.entries[file_index.changed[i]].flags &= ~INDEX_CHANGED;
     }
+    file_index.changed_count = 0;
+    file_index.columns_ready = false;
 }
 
-void crequest(int client_socket)
-{
-    char buffer[BUFFER_SIZE];
-    int file_fd;
+void index_set_stat(uint32_t id, const struct stat *st) {
+    index_entry_t *entry = &file_index.entries[id];
+    entry->mode = st->st_mode;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->ctime = st->st_ctime;
 
-    char client_message[2000];
-    char command[1000], server_reply[2000];
-    char *args[MAX_ARGS];
-    int num_args;
-    while (1)
-    {
-        // Receive message from client
-        int read_size = recv(client_socket, client_message, 2000, 0);
-        if (read_size == 0)
-        {
-            printf("Client disconnected\n");
-            break;
+    // Once the columns are sorted, remember which files they no longer describe
+    if (file_index.columns_ready && !(entry->flags & INDEX_CHANGED)) {
+        if (file_index.changed_count == INDEX_MAX_CHANGED) {
+            index_reset_columns();
+            return;
         }
-        // Add null terminator to message
-        client_message[read_size] = '\0';
-        printf("\nClient message: %s", client_message);
-        char temp[1000];
-        sprintf(temp, "%s", client_message);
-        // call commands
-        // break raw command
-        num_args = 0;
-        args[num_args] = strtok(temp, " \n");
-        int file_transfer = 0;
-        while (args[num_args] != NULL && num_args < MAX_ARGS - 1)
-        {
-            num_args++;
-            args[num_args] = strtok(NULL, " \n");
-        }
-
-        // commands
-        int command_success_flag = 0;
-        char message[1000];
-        if (strcmp(args[0], "w24fn") == 0)
-        {
-            printf("Find Files Function Invoked\n");
-            file_transfer = 0;
-            char *filename = args[1];
-            char *path = getenv("HOME");
-            int found = 0;
-            findfile(client_socket, filename, path, &found);
-            if (found == 0)
-            {
-                printf("File not found\n");
-                memset(message, 0, sizeof(message));
-                sprintf(message, "File not found\n");
-                message[strlen(message)] = '\0';
-                if (send(client_socket, message, strlen(message), 0) < 0)
-                {
-                    perror("send failed");
-                    exit(EXIT_FAILURE);
-                }
-                memset(message, 0, sizeof(message));
-            }
-        }        
-        else if (strcmp(args[0], "w24fz") == 0)
-	{
-    		printf("File Search Function Invoked\n");
-    		char size1_str[20];
-	    	char size2_str[20];
-	    	long size1 = atol(args[1]);
-	    	long size2 = atol(args[2]);
-
-  	    	// Convert size1 and size2 from long to string for the command
-	    	snprintf(size1_str, sizeof(size1_str), "%ldc", size1); // 'c' specifies bytes in find command
-	    	snprintf(size2_str, sizeof(size2_str), "%ldc", size2);
-
-	    	char home_dir[1024];
-	    	snprintf(home_dir, sizeof(home_dir), "%s", getenv("HOME"));
-
-	    	// Call sgetfiles with the converted string sizes and the client socket
-	    	// The sgetfiles function itself will handle file sending or sending "No file found"
-	    	sgetfiles(home_dir, "temp.tar.gz", size1_str, size2_str, client_socket);
-	}
-
-        else if (strcmp(args[0], "w24ft") == 0)
-        {
-            printf("Generate TAR Files Function Invoked\n");
-            char **extensions = malloc((num_args - 1) * sizeof(char *));
-            for (int i = 1; i < num_args; i++)
-            {
-                extensions[i - 1] = args[i];
-            }
-            int num_extensions = num_args - 1;
-
-            if (num_args == 4)
-            {
-                num_extensions--;
-            }
-
-            char tar_filename[] = "temp.tar.gz";
-            generate_tar_gz_from_files_with_extensions(tar_filename, extensions, num_extensions);
-            file_transfer = 1;
-            if ((file_fd = open("temp.tar.gz", O_RDONLY)) == -1)
-            {
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-       	     ssize_t read_bytes;
-             while ((read_bytes = read(file_fd, buffer, BUFFER_SIZE)) > 0)
-             {
-                 if (send(client_socket, buffer, read_bytes, 0) == -1)
-                 {
-                     perror("send");
-                     exit(EXIT_FAILURE);
-                 }
-             }
-             close(file_fd);
-        }
-        
-        else if (strcmp(args[0], "w24fdb") == 0) {
-	    if (num_args != 2) {
-	        printf("Usage: w24fdb date\n");
-	    } else {
-	    	printf("Search Before Date Function Invoked\n");
-	    	char home_dir[1024];
-            	snprintf(home_dir, sizeof(home_dir), "%s", getenv("HOME"));
-        	dgetfiles_before(home_dir, "temp.tar.gz", args[1], client_socket);
-    		}
-	} 
-	else if (strcmp(args[0], "w24fda") == 0) {
-    	if (num_args != 2) {
-        	printf("Usage: w24fda date\n");
-    	} else {
-    		printf("Search After Date Function Invoked\n");
-        	char home_dir[1024];
-        	snprintf(home_dir, sizeof(home_dir), "%s", getenv("HOME"));
-        	dgetfiles_after(home_dir, "temp.tar.gz", args[1], client_socket);
-    		}
-	}
-
-	else if (strcmp(args[0], "dirlist") == 0 && strcmp(args[1], "-a") == 0) {
-		printf("List Directories By File Name Invoked\n");
-    		list_subdirectories(client_socket);
-	}
-
-	else if (strcmp(args[0], "dirlist") == 0 && strcmp(args[1], "-t") == 0) {
-		printf("List Directories By File Date Invoked\n");
-    		list_subdirectories_by_time(client_socket);
-	}
-
-        else if (strcmp(args[0], "quitc") == 0)
-        {
-            printf("Client requested to exit\n");
-            break;
-        }
-        
-        if (file_transfer)
-        {
-            printf("Transfering file to client\n");
-            send_file(client_socket, "temp.tar.gz");
+        if (file_index.changed_count == file_index.changed_capacity) {
+            file_index.changed_capacity = file_index.changed_capacity ? file_index.changed_capacity * 2 : 256;
+            file_index.changed = realloc(file_index.changed, file_index.changed_capacity * sizeof(uint32_t));
         }
+        entry->flags |= INDEX_CHANGED;
+        file_index.changed[file_index.changed_count++] = id;
     }
-    close(client_socket);
 }
 
-void handle_mirror1(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
+// Tells whether a table of the index still points into the mapped snapshot
+bool index_in_snapshot(const void *table) {
+    const char *start = table;
+    return file_index.snapshot != NULL && start >= file_index.snapshot && start < file_index.snapshot + file_index.snapshot_size;
+}
 
-    // Receive data from client with error checking
-    bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received < 0) {
-        perror("Error: Failed to receive data from client");
-        exit(1);
+// Resizes the table or the string pool. While they still point into the snapshot they are copied to the heap.
+void *index_grow(void *table, size_t used, size_t size) {
+    if (!index_in_snapshot(table)) {
+        return realloc(table, size);
     }
-    buffer[bytes_received] = '\0'; // Null-terminate received data
-    printf("Received data from client: %s\n", buffer);
-
-    // Setting up mirror server address
-    struct sockaddr_in mirror_addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = inet_addr(SERVER_IP),
-        .sin_port = htons(8081), // Assuming the mirror server port is 8081
-    };
-
-    // Creating socket for mirror server and connecting
-    int mirror_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (mirror_socket < 0 || connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(mirror_addr)) < 0) {
-        perror("Error: Failed to setup connection to mirror server");
-        close(client_socket); // Ensure client socket is also closed before exiting
-        exit(1);
+    void *copy = malloc(size);
+    if (copy) {
+        memcpy(copy, table, used);
     }
+    return copy;
+}
 
-    // Forwarding client's data to the mirror server and checking for errors
-    if (send(mirror_socket, buffer, bytes_received, 0) < 0) {
-        perror("Error: Failed to send data to mirror server");
-        close(client_socket);
-        close(mirror_socket);
-        exit(1);
+// FNV-1a, the hash of the name tables and of the snapshot file names
+uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
     }
+    return hash;
+}
 
-    // Receiving response from the mirror server
-    bytes_received = recv(mirror_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received < 0) {
-        perror("Error: Failed to receive data from mirror server");
-        close(client_socket);
-        close(mirror_socket);
-        exit(1);
+// Finds the slot of a name, or the free slot where it would go
+name_slot_t *index_find_name(name_table_t *table, const char *name, size_t length, uint32_t hash) {
+    uint32_t mask = table->slot_count - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        name_slot_t *slot = &table->slots[i];
+        if (slot->name == INDEX_NONE ||
+            (slot->hash == hash && strncmp(file_index.names + slot->name, name, length) == 0 && file_index.names[slot->name + length] == '\0')) {
+            return slot;
+        }
     }
+}
 
-    // Forwarding the mirror server's response back to the client
-    buffer[bytes_received] = '\0'; // Ensure buffer is null-terminated
-    printf("Received data from mirror server: %s\n", buffer);
-    if (send(client_socket, buffer, bytes_received, 0) < 0) {
-        perror("Error: Failed to send data back to client");
-        // Only close mirror_socket here because client_socket will be closed outside
-        close(mirror_socket);
+// Makes room for one more string in a hash table: doubles it once it is 3/4 full, or allocates it
+void index_reserve_name(name_table_t *table) {
+    if ((table->used + 1) * 4 <= table->slot_count * 3) {
+        return;
+    }
+    name_slot_t *old_slots = table->slots;
+    uint32_t old_count = table->slot_count;
+    table->slot_count = old_count ? old_count * 2 : INDEX_INITIAL_NAME_SLOTS;
+    table->slots = malloc(table->slot_count * sizeof(name_slot_t));
+    if (table->slots == NULL) {
+        fprintf(stderr, "Error: Out of memory while indexing\n");
         exit(1);
     }
+    memset(table->slots, 0xff, table->slot_count * sizeof(name_slot_t)); // Every name INDEX_NONE
 
-    // Cleanup: Close mirror socket but not the client socket, as it may be used further
-    close(mirror_socket);
+    uint32_t mask = table->slot_count - 1;
+    for (uint32_t i = 0; i < old_count; i++) {
+        if (old_slots[i].name == INDEX_NONE) {
+            continue;
+        }
+        uint32_t j = old_slots[i].hash & mask;
+        while (table->slots[j].name != INDEX_NONE) {
+            j = (j + 1) & mask;
+        }
+        table->slots[j] = old_slots[i];
+    }
+    if (!index_in_snapshot(old_slots)) {
+        free(old_slots);
+    }
 }
 
-void handle_mirror2(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
-
-    // Receive data from client with error checking
-    bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received < 0) {
-        perror("Error: Failed to receive data from client");
-        exit(1);
+// Appends an entry, returns its number
+uint32_t index_add(uint32_t parent, const char *name, const struct stat *st) {
+    size_t name_length = strlen(name);
+    uint32_t hash = hash_name(name, name_length);
+    index_reserve_name(&file_index.name_table);
+    index_reserve_name(&file_index.extension_table);
+    if (file_index.count == file_index.capacity) {
+        file_index.capacity = file_index.capacity ? file_index.capacity * 2 : INDEX_INITIAL_ENTRIES;
+        file_index.entries = index_grow(file_index.entries, file_index.count * sizeof(index_entry_t), file_index.capacity * sizeof(index_entry_t));
     }
-    buffer[bytes_received] = '\0'; // Null-terminate received data
-    printf("Received data from client: %s\n", buffer);
-
-    // Setting up mirror server address
-    struct sockaddr_in mirror_addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = inet_addr(SERVER_IP),
-        .sin_port = htons(8083),
-    };
-
-    // Creating socket for mirror server and connecting
-    int mirror_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (mirror_socket < 0 || connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(mirror_addr)) < 0) {
-        perror("Error: Failed to setup connection to mirror server");
-        close(client_socket); // Ensure client socket is also closed before exiting
-        exit(1);
+    while (file_index.names_length + name_length + 1 > file_index.names_capacity) {
+        file_index.names_capacity = file_index.names_capacity ? file_index.names_capacity * 2 : INDEX_INITIAL_NAMES;
+        file_index.names = index_grow(file_index.names, file_index.names_length, file_index.names_capacity);
     }
-
-    // Forwarding client's data to the mirror server and checking for errors
-    if (send(mirror_socket, buffer, bytes_received, 0) < 0) {
-        perror("Error: Failed to send data to mirror server");
-        close(client_socket);
-        close(mirror_socket);
+    if (file_index.entries == NULL || file_index.names == NULL) {
+        fprintf(stderr, "Error: Out of memory while indexing\n");
         exit(1);
     }
 
-    // Receiving response from the mirror server
-    bytes_received = recv(mirror_socket, buffer, BUFFER_SIZE, 0);
-    if (bytes_received < 0) {
-        perror("Error: Failed to receive data from mirror server");
-        close(client_socket);
-        close(mirror_socket);
-        exit(1);
+    uint32_t id = file_index.count++;
+    index_entry_t *entry = &file_index.entries[id];
+    name_slot_t *slot = index_find_name(&file_index.name_table, name, name_length, hash);
+    if (slot->name == INDEX_NONE) {
+        // First entry with this name, store the name
+        slot->name = file_index.names_length;
+        slot->hash = hash;
+        slot->first = id;
+        file_index.name_table.used++;
+        memcpy(file_index.names + file_index.names_length, name, name_length + 1);
+        file_index.names_length += name_length + 1;
+    } else {
+        file_index.entries[slot->last].next_same_name = id;
     }
+    slot->last = id;
 
-    // Forwarding the mirror server's response back to the client
-    buffer[bytes_received] = '\0'; // Ensure buffer is null-terminated
-    printf("Received data from mirror server: %s\n", buffer);
-    if (send(client_socket, buffer, bytes_received, 0) < 0) {
-        perror("Error: Failed to send data back to client");
-        // Only close mirror_socket here because client_socket will be closed outside
-        close(mirror_socket);
-        exit(1);
+    const char *dot = strrchr(name, '.');
+    entry->parent = parent;
+    entry->name = slot->name;
+    entry->name_length = name_length;
+    entry->extension = (dot && dot != name) ? dot - name + 1 : 0;
+    entry->first_child = INDEX_NONE;
+    entry->next_sibling = INDEX_NONE;
+    entry->next_same_name = INDEX_NONE;
+    entry->next_same_extension = INDEX_NONE;
+    entry->flags = 0;
+    index_set_stat(id, st);
+
+    if (entry->extension) {
+        // The extension is the tail of the interned name, so it needs no storage of its own
+        const char *extension = name + entry->extension;
+        size_t extension_length = name_length - entry->extension;
+        name_slot_t *extension_slot = index_find_name(&file_index.extension_table, extension, extension_length,
+                                                      hash_name(extension, extension_length));
+        if (extension_slot->name == INDEX_NONE) {
+            extension_slot->name = entry->name + entry->extension;
+            extension_slot->hash = hash_name(extension, extension_length);
+            extension_slot->first = id;
+            file_index.extension_table.used++;
+        } else {
+            file_index.entries[extension_slot->last].next_same_extension = id;
+        }
+        extension_slot->last = id;
     }
 
-    // Cleanup: Close mirror socket but not the client socket, as it may be used further
-    close(mirror_socket);
+    if (parent != INDEX_NONE) {
+        entry->next_sibling = file_index.entries[parent].first_child;
+        file_index.entries[parent].first_child = id;
+    }
+    return id;
 }
 
-int main()
-{
+// Parallel walk of the tree that builds the index. Every thread has a deque of directories still to read: it
+// takes its own from the bottom and steals from the top of the others' when it runs out. A directory is read
+// in bulk with getdents64() and its entries are stat'ed in batches relative to it, through the thread's
+// io_uring, so no path is built.
+// Nothing is added to the index while the threads run. Once they are done the directories are added depth
+// first in the order getdents64() returned them, so the index is the same as one built by a single walk.
+typedef struct walk_directory walk_directory_t;
 
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len;
-    int clients_count = 0;
-    int opt = 1;
+typedef struct {
+    uint32_t name; // Offset of the name in the directory's names
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+    walk_directory_t *child; // What the walk found in it, when it is a directory
+} walk_item_t;
 
-    // Create a socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1)
-    {
-        perror("Error: Failed to create socket");
-        exit(1);
-    }
+struct walk_directory {
+    walk_directory_t *parent; // NULL for the root
+    char *name; // Name in the parent, used when the directory has to be opened by path
+    int fd; // Opened ahead of time by the thread that found it, -1 if it is opened by path
+    walk_item_t *items; // Regular files and directories, in getdents64() order
+    uint32_t count;
+    uint32_t capacity;
+    char *names; // Names of the items, null-terminated
+    size_t names_length;
+    size_t names_capacity;
+};
 
-    // Set socket options to reuse address and port
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
-    {
-        perror("Error: Failed to set 'setsockopt' for reusing address");
+typedef struct {
+    pthread_mutex_t lock;
+    walk_directory_t **tasks; // Directories waiting, from top to bottom
+    size_t top; // Next one to be stolen
+    size_t bottom; // One past the next one the owner takes
+    size_t capacity;
+} walk_deque_t;
+
+typedef struct {
+    walk_deque_t deques[WALK_MAX_THREADS];
+    int threads;
+    int root_fd; // Directories not opened ahead of time are opened relative to it
+    long pending; // Directories found but not read yet
+    long open_directories; // Directories opened ahead of time and not closed yet
+    pthread_mutex_t idle_lock; // Held by a thread going to sleep, and by one waking it
+    pthread_cond_t work_ready; // Signaled when a directory is pushed while threads sleep, or pending reaches 0
+    int sleeping; // Threads waiting on work_ready
+    unsigned long pushed; // Directories pushed so far, tells a thread about to sleep that work turned up
+} walk_t;
+
+typedef struct {
+    walk_t *walk;
+    int self; // Deque of this thread
+    char *buffer; // Directory entries read by getdents64()
+    stat_ring_t ring;
+    char *names[WALK_STAT_BATCH]; // Names of the batch being stat'ed, they point into buffer
+    struct statx results[WALK_STAT_BATCH];
+    int status[WALK_STAT_BATCH];
+} walk_thread_t;
+
+void walk_push(walk_deque_t *deque, walk_directory_t *directory) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        if (deque->top > 0) {
+            // Reuse the room left by stolen directories
+            memmove(deque->tasks, deque->tasks + deque->top, (deque->bottom - deque->top) * sizeof(walk_directory_t *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(walk_directory_t *));
+            if (deque->tasks == NULL) {
+                fprintf(stderr, "Error: Out of memory while indexing\n");
+                exit(1);
+            }
+        }
     }
+    deque->tasks[deque->bottom++] = directory;
+    pthread_mutex_unlock(&deque->lock);
+}
 
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP); // INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);          // Port number for server
+// Takes a directory from the bottom (the owner) or the top (a thief), NULL if the deque is empty
+walk_directory_t *walk_take(walk_deque_t *deque, bool steal) {
+    walk_directory_t *directory = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        directory = steal ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+    }
+    if (deque->top == deque->bottom) {
+        deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return directory;
+}
 
-    // Bind the server address to the socket
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
-    {
-        perror("Error: Failed to bind socket");
-        exit(1);
+// Opens a directory that was not opened ahead of time, by its path from the root
+int walk_open_by_path(walk_t *walk, walk_directory_t *directory) {
+    char path[MAX_PATH_LENGTH];
+    size_t length = 0;
+    const char *components[MAX_PATH_LENGTH / 2];
+    int depth = 0;
+    for (walk_directory_t *d = directory; d->parent != NULL && depth < (int)(sizeof(components) / sizeof(components[0])); d = d->parent) {
+        components[depth++] = d->name;
     }
+    path[0] = '\0';
+    while (depth > 0 && length < sizeof(path)) {
+        length += snprintf(path + length, sizeof(path) - length, "%s%s", length ? "/" : "", components[--depth]);
+    }
+    return openat(walk->root_fd, length ? path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
 
-    // Listen for incoming connections
-    if (listen(server_socket, MAX_CLIENTS) == -1)
-    {
-        perror("Error: Failed to listen");
+// Records one regular file or directory of a directory. A directory is handed to the deque of this thread.
+void walk_add_item(walk_thread_t *thread, walk_directory_t *directory, int fd, const char *name, const struct statx *stx) {
+    walk_t *walk = thread->walk;
+    size_t name_length = strlen(name);
+    if (directory->count == directory->capacity) {
+        directory->capacity = directory->capacity ? directory->capacity * 2 : 16;
+        directory->items = realloc(directory->items, directory->capacity * sizeof(walk_item_t));
+    }
+    while (directory->names_length + name_length + 1 > directory->names_capacity) {
+        directory->names_capacity = directory->names_capacity ? directory->names_capacity * 2 : 256;
+        directory->names = realloc(directory->names, directory->names_capacity);
+    }
+    if (directory->items == NULL || directory->names == NULL) {
+        fprintf(stderr, "Error: Out of memory while indexing\n");
         exit(1);
     }
+    walk_item_t *item = &directory->items[directory->count++];
+    item->name = directory->names_length;
+    item->mode = stx->stx_mode;
+    item->size = stx->stx_size;
+    item->mtime = stx->stx_mtime.tv_sec;
+    item->ctime = stx->stx_ctime.tv_sec;
+    item->child = NULL;
+    memcpy(directory->names + directory->names_length, name, name_length + 1);
+    directory->names_length += name_length + 1;
 
-    printf("Server is listening for incoming connections...\n");
-
-    while (1)
-    {
-        // Accept incoming connections
-        client_addr_len = sizeof(client_addr);
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_socket == -1)
-        {
-            perror("Error: Failed to accept connection");
+    if (S_ISDIR(stx->stx_mode)) {
+        walk_directory_t *child = calloc(1, sizeof(walk_directory_t));
+        if (child == NULL || (child->name = strdup(name)) == NULL) {
+            fprintf(stderr, "Error: Out of memory while indexing\n");
             exit(1);
         }
+        child->parent = directory;
+        child->fd = -1;
+        // Open it now while the parent is at hand, unless too many are open already
+        if (__atomic_add_fetch(&walk->open_directories, 1, __ATOMIC_RELAXED) <= WALK_MAX_OPEN) {
+            child->fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (child->fd == -1) {
+            __atomic_sub_fetch(&walk->open_directories, 1, __ATOMIC_RELAXED);
+        }
+        item->child = child;
+        __atomic_add_fetch(&walk->pending, 1, __ATOMIC_RELAXED);
+        walk_push(&walk->deques[thread->self], child);
+        __atomic_add_fetch(&walk->pushed, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&walk->sleeping, __ATOMIC_SEQ_CST) > 0) {
+            pthread_mutex_lock(&walk->idle_lock);
+            pthread_cond_signal(&walk->work_ready);
+            pthread_mutex_unlock(&walk->idle_lock);
+        }
+    }
+}
 
-        printf("\nClient connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+// Stats the names of a batch and records those that are regular files or directories, in order
+void walk_stat_batch(walk_thread_t *thread, walk_directory_t *directory, int fd, int count) {
+    // Symbolic links are not followed, only regular files and directories are indexed
+    stat_batch(&thread->ring, fd, thread->names, count, AT_SYMLINK_NOFOLLOW, thread->results, thread->status);
+    for (int i = 0; i < count; i++) {
+        mode_t mode = thread->results[i].stx_mode;
+        if (thread->status[i] == 0 && (S_ISREG(mode) || S_ISDIR(mode))) {
+            walk_add_item(thread, directory, fd, thread->names[i], &thread->results[i]);
+        }
+    }
+}
 
-        // Handle the first 3 client connections in the server
-        if (clients_count < 3 || (clients_count >= 9 && clients_count % 3 == 0))
-        {
-            pid_t pid = fork();
-            if (pid == -1)
-            {
-                close(client_socket);
-                perror("Error: Could not fork to handle client");
-                continue;
-            }
-            else if (pid == 0)
-            {
-                // Child process
-                printf("Client %d handled by Server\n", clients_count + 1);
-                close(server_socket); // Close unused server socket
-                crequest(client_socket);
-                exit(EXIT_SUCCESS);
-            }
-            else
-            {
-                clients_count++; // Increment count of clients.
-                printf("No. of Clients handled: %d\n", clients_count);
-                // Parent process
-                close(client_socket); // Close unused client socket
-            }
+// Reads one directory: stats its entries and hands the directories found in it to the deque of this thread
+void walk_read_directory(walk_thread_t *thread, walk_directory_t *directory) {
+    walk_t *walk = thread->walk;
+    int fd = directory->fd;
+    if (fd == -1) {
+        fd = walk_open_by_path(walk, directory);
+        if (fd == -1) {
+            return; // Removed or not readable, it stays empty like a failed opendir() did
         }
-        
-        else if ((clients_count >= 3 &&  clients_count < 6)|| (clients_count >= 9 && clients_count % 3 == 1))
-        {
-            pid_t pid = fork();
-            if (pid == -1)
-            {
-                close(client_socket);
-                perror("Error: Coult not fork to handle client");
+    } else {
+        __atomic_sub_fetch(&walk->open_directories, 1, __ATOMIC_RELAXED);
+    }
+
+    ssize_t length;
+    while ((length = getdents64(fd, thread->buffer, WALK_BUFFER_SIZE)) > 0) {
+        int count = 0;
+        for (ssize_t offset = 0; offset < length;) {
+            struct dirent64 *dp = (struct dirent64 *)(thread->buffer + offset);
+            offset += dp->d_reclen;
+            if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 ||
+                (dp->d_type != DT_REG && dp->d_type != DT_DIR && dp->d_type != DT_UNKNOWN)) {
                 continue;
             }
-            else if (pid == 0)
-            {
-                // Child process
-                printf("Client %d handled by the Mirror 1\n", clients_count + 1);
-                close(server_socket); // Close unused server socket
-                handle_mirror1(client_socket);
-                exit(EXIT_SUCCESS);
+            thread->names[count++] = dp->d_name;
+            if (count == WALK_STAT_BATCH) {
+                walk_stat_batch(thread, directory, fd, count);
+                count = 0;
             }
-            else
+        }
+        walk_stat_batch(thread, directory, fd, count);
+    }
+    close(fd);
+}
+
+void *walk_thread(void *arg) {
+    walk_thread_t *thread = arg;
+    walk_t *walk = thread->walk;
+    thread->buffer = malloc(WALK_BUFFER_SIZE);
+    if (thread->buffer == NULL) {
+        fprintf(stderr, "Error: Out of memory while indexing\n");
+        exit(1);
+    }
+    stat_ring_init(&thread->ring);
+
+    while (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0) {
+        unsigned long pushed = __atomic_load_n(&walk->pushed, __ATOMIC_SEQ_CST);
+        walk_directory_t *directory = walk_take(&walk->deques[thread->self], false);
+        for (int i = 1; directory == NULL && i < walk->threads; i++) {
+            directory = walk_take(&walk->deques[(thread->self + i) % walk->threads], true);
+        }
+        if (directory == NULL) {
+            // Every directory left is being read, sleep until one of them turns up more or the walk ends.
+            // A push after the deques were looked at changes pushed, so its signal is never missed.
+            pthread_mutex_lock(&walk->idle_lock);
+            __atomic_add_fetch(&walk->sleeping, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&walk->pushed, __ATOMIC_SEQ_CST) == pushed && __atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0) {
+                pthread_cond_wait(&walk->work_ready, &walk->idle_lock);
+            }
+            __atomic_sub_fetch(&walk->sleeping, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&walk->idle_lock);
+            continue;
+        }
+        walk_read_directory(thread, directory);
+        // After its subdirectories were counted. The last directory wakes everyone up to leave.
+        if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&walk->idle_lock);
+            pthread_cond_broadcast(&walk->work_ready);
+            pthread_mutex_unlock(&walk->idle_lock);
+        }
+    }
+    stat_ring_free(&thread->ring);
+    free(thread->buffer);
+    return NULL;
+}
+
+// Adds what the walk found in a directory to the index, depth first, and frees it
+void walk_add_to_index(walk_directory_t *directory, uint32_t parent) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    for (uint32_t i = 0; i < directory->count; i++) {
+        walk_item_t *item = &directory->items[i];
+        st.st_mode = item->mode;
+        st.st_size = item->size;
+        st.st_mtime = item->mtime;
+        st.st_ctime = item->ctime;
+        uint32_t entry = index_add(parent, directory->names + item->name, &st);
+        if (item->child) {
+            walk_add_to_index(item->child, entry);
+        }
+    }
+    free(directory->items);
+    free(directory->names);
+    free(directory->name);
+    if (directory->parent) {
+        free(directory);
+    }
+}
+
+// Adds everything below the root directory of the index
+void index_walk(int root_fd) {
+    static walk_t walk; // Too big for the stack
+    walk_directory_t root = {.fd = openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    if (root.fd == -1) {
+        perror("Failed to open directory");
+        return;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    memset(&walk, 0, sizeof(walk));
+    walk.threads = cpus < 1 ? 1 : cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS : (int)cpus;
+    walk.root_fd = root_fd;
+    walk.pending = 1;
+    walk.open_directories = 1;
+    for (int i = 0; i < walk.threads; i++) {
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&walk.idle_lock, NULL);
+    pthread_cond_init(&walk.work_ready, NULL);
+    walk_push(&walk.deques[0], &root);
+
+    pthread_t threads[WALK_MAX_THREADS];
+    static walk_thread_t arguments[WALK_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < walk.threads; i++) {
+        arguments[i].walk = &walk;
+        arguments[i].self = i;
+        if (pthread_create(&threads[i], NULL, walk_thread, &arguments[i]) == 0) {
+            started++;
+        } else if (i == 0) {
+            perror("Error: Failed to start the index walk");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < walk.threads; i++) {
+        free(walk.deques[i].tasks);
+        pthread_mutex_destroy(&walk.deques[i].lock);
+    }
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.work_ready);
+
+    walk_add_to_index(&root, 0);
+}
+
+// Builds the index of a directory tree, called once at startup
+void build_index(const char *root) {
+    long start_us = now_us();
+    struct stat st;
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1 || fstat(root_fd, &st) == -1) {
+        perror("Error: Failed to open the home directory");
+        exit(1);
+    }
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    file_index.count = 0;
+    file_index.removed = 0;
+    file_index.names_length = 0;
+    file_index.trigrams_ready = false;
+    index_reset_columns();
+    name_table_t *tables[] = {&file_index.name_table, &file_index.extension_table};
+    for (int i = 0; i < 2; i++) {
+        tables[i]->used = 0;
+        if (tables[i]->slots) {
+            memset(tables[i]->slots, 0xff, tables[i]->slot_count * sizeof(name_slot_t));
+        }
+    }
+    index_add(INDEX_NONE, root, &st);
+    index_walk(root_fd);
+    pthread_rwlock_unlock(&file_index.lock);
+    close(root_fd);
+
+    printf("Indexed %u entries under %s in %ld ms\n", file_index.count, root, (now_us() - start_us) / 1000);
+}
+
+// Writes the full path of an entry, the caller holds the index lock
+void index_path(uint32_t entry, char *path, size_t size) {
+    uint32_t chain[MAX_PATH_LENGTH / 2];
+    int depth = 0;
+    for (uint32_t id = entry; id != INDEX_NONE && depth < (int)(sizeof(chain) / sizeof(chain[0])); id = file_index.entries[id].parent) {
+        chain[depth++] = id;
+    }
+
+    size_t length = 0;
+    path[0] = '\0';
+    while (depth-- > 0 && length < size) {
+        index_entry_t *component = &file_index.entries[chain[depth]];
+        length += snprintf(path + length, size - length, "%s%s", length ? "/" : "", file_index.names + component->name);
+    }
+}
+
+// Index maintenance: every acceptor process runs a watcher thread that follows the changes below the home
+// directory with inotify and applies them to its copy of the index, so queries stay fresh without new walks.
+// When the kernel drops events, directories whose mtime moved are rescanned instead of the whole tree.
+int inotify_fd = -1;
+uint32_t *watched_directories; // Directory entry of each watch descriptor, INDEX_NONE if unused
+int watch_capacity; // Size of watched_directories
+bool out_of_watches; // inotify refused a watch, reported once
+bool index_followed; // The watcher thread is running, with out_of_watches unset the index sees every change
+bool index_behind = false; // Set in the parent once the first acceptors are forked, its index no longer follows the tree
+
+void index_rescan_directory(uint32_t directory);
+
+// Returns the entry with the given name in a directory, or INDEX_NONE
+uint32_t index_find_child(uint32_t directory, const char *name) {
+    size_t length = strlen(name);
+    uint32_t interned = index_find_name(&file_index.name_table, name, length, hash_name(name, length))->name;
+    if (interned == INDEX_NONE) {
+        return INDEX_NONE; // No entry anywhere has this name
+    }
+    // Names are interned, so comparing offsets is enough
+    for (uint32_t child = file_index.entries[directory].first_child; child != INDEX_NONE; child = file_index.entries[child].next_sibling) {
+        if (file_index.entries[child].name == interned) {
+            return child;
+        }
+    }
+    return INDEX_NONE;
+}
+
+void index_mark_removed(uint32_t id) {
+    index_entry_t *entry = &file_index.entries[id];
+    for (uint32_t child = entry->first_child; child != INDEX_NONE; child = file_index.entries[child].next_sibling) {
+        index_mark_removed(child);
+    }
+    entry->mode = 0;
+    entry->first_child = INDEX_NONE;
+    file_index.removed++;
+}
+
+// Takes an entry, and everything below it, out of the index
+void index_remove(uint32_t id) {
+    uint32_t *link = &file_index.entries[file_index.entries[id].parent].first_child;
+    while (*link != INDEX_NONE && *link != id) {
+        link = &file_index.entries[*link].next_sibling;
+    }
+    if (*link == id) {
+        *link = file_index.entries[id].next_sibling;
+    }
+    index_mark_removed(id);
+}
+
+void index_watch_directory(uint32_t directory) {
+    char path[MAX_PATH_LENGTH];
+    index_path(directory, path, sizeof(path));
+    int wd = inotify_add_watch(inotify_fd, path, INDEX_WATCH_EVENTS);
+    if (wd == -1) {
+        if (errno == ENOSPC && !out_of_watches) {
+            fprintf(stderr, "Error: Out of inotify watches, raise fs.inotify.max_user_watches to keep the index fresh\n");
+            out_of_watches = true;
+        }
+        return;
+    }
+    if (wd >= watch_capacity) {
+        int capacity = watch_capacity ? watch_capacity : 1024;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        watched_directories = realloc(watched_directories, capacity * sizeof(uint32_t));
+        for (int i = watch_capacity; i < capacity; i++) {
+            watched_directories[i] = INDEX_NONE;
+        }
+        watch_capacity = capacity;
+    }
+    watched_directories[wd] = directory; // A moved directory keeps its watch descriptor, it now points at the new entry
+}
+
+// Tells whether a directory may hold changes the index hasn't seen. Timestamps only have a resolution of one
+// second here, so a directory changed in the last second counts as changed even if its mtime matches.
+bool directory_changed(const index_entry_t *entry, const struct stat *st) {
+    return st->st_mtime != entry->mtime || st->st_ctime != entry->ctime || st->st_mtime >= time(NULL) - 1;
+}
+
+// Brings one name of a directory up to date with the disk: adds, updates or removes its entry.
+// New directories are watched and scanned, directories that changed are rescanned.
+void index_refresh_child(uint32_t directory, const char *name) {
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    index_path(directory, path, sizeof(path));
+    size_t length = strlen(path);
+    snprintf(path + length, sizeof(path) - length, "/%s", name);
+
+    bool exists = lstat(path, &st) == 0 && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode));
+    uint32_t child = index_find_child(directory, name);
+    if (child != INDEX_NONE && (!exists || S_ISDIR(st.st_mode) != S_ISDIR(file_index.entries[child].mode))) {
+        index_remove(child);
+        child = INDEX_NONE;
+    }
+    if (!exists) {
+        return;
+    }
+
+    if (child == INDEX_NONE) {
+        child = index_add(directory, name, &st);
+        if (S_ISDIR(st.st_mode)) {
+            index_watch_directory(child); // Watch first, so nothing created during the scan is missed
+            index_rescan_directory(child);
+        }
+    } else if (S_ISDIR(st.st_mode) && directory_changed(&file_index.entries[child], &st)) {
+        index_rescan_directory(child);
+    } else {
+        index_set_stat(child, &st);
+    }
+}
+
+// Reconciles the entries of a directory with its contents on disk
+void index_rescan_directory(uint32_t directory) {
+    char path[MAX_PATH_LENGTH];
+    char name[NAME_MAX + 1];
+    struct stat st;
+    index_path(directory, path, sizeof(path));
+
+    // Stat the directory before reading it, a change made during the scan then still shows as a newer mtime
+    if (lstat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return; // Gone, the event for its parent removes it
+    }
+    index_set_stat(directory, &st);
+
+    // Update or drop the entries already known
+    uint32_t child = file_index.entries[directory].first_child;
+    while (child != INDEX_NONE) {
+        uint32_t next = file_index.entries[child].next_sibling;
+        snprintf(name, sizeof(name), "%s", file_index.names + file_index.entries[child].name); // The pool may move
+        index_refresh_child(directory, name);
+        child = next;
+    }
+
+    // Add the names that are new
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0 && index_find_child(directory, dp->d_name) == INDEX_NONE) {
+            index_refresh_child(directory, dp->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+// Rescans the directories whose mtime or ctime no longer matches the index, used after lost events and
+// to validate a snapshot. Returns the number of directories rescanned.
+int index_recover(void) {
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    int rescanned = 0;
+    for (uint32_t i = 0; i < file_index.count; i++) {
+        index_entry_t *entry = &file_index.entries[i];
+        if (!S_ISDIR(entry->mode)) {
+            continue;
+        }
+        index_path(i, path, sizeof(path));
+        if (lstat(path, &st) == 0 && directory_changed(entry, &st)) {
+            index_rescan_directory(i);
+            rescanned++;
+        }
+    }
+    return rescanned;
+}
+
+// Names the snapshot after the user and the served directory, so servers of the same tree share one file
+void default_snapshot_path(const char *root, char *path, size_t size) {
+    snprintf(path, size, "/tmp/w24index-%u-%08x.bin", (unsigned)getuid(), hash_name(root, strlen(root)));
+}
+
+// Saves the index to its snapshot file. The file is written under a temporary name and renamed over the old
+// one, so processes that still map the old snapshot keep a consistent copy.
+void index_save_snapshot(const char *path) {
+    // mkstemp() creates a new file only readable by us, the default path is in /tmp where others could
+    // have put a symlink or a file of their own under a predictable name
+    char temporary[MAX_PATH_LENGTH + 32];
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    FILE *snapshot = fd == -1 ? NULL : fdopen(fd, "wb");
+    if (snapshot == NULL) {
+        perror("Error: Failed to save the index snapshot");
+        if (fd != -1) {
+            close(fd);
+            unlink(temporary);
+        }
+        return;
+    }
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    index_snapshot_header_t header = {
+        .version = INDEX_SNAPSHOT_VERSION,
+        .entry_size = sizeof(index_entry_t),
+        .count = file_index.count,
+        .removed = file_index.removed,
+        .names_length = file_index.names_length,
+        .entries_offset = INDEX_SNAPSHOT_ALIGN,
+        .name_slot_count = file_index.name_table.slot_count,
+        .distinct_names = file_index.name_table.used,
+        .extension_slot_count = file_index.extension_table.slot_count,
+        .distinct_extensions = file_index.extension_table.used,
+    };
+    uint64_t names_end = INDEX_SNAPSHOT_ALIGN + (uint64_t)file_index.count * sizeof(index_entry_t) + file_index.names_length;
+    header.name_slots_offset = (names_end + 7) & ~(uint64_t)7;
+    header.extension_slots_offset = header.name_slots_offset + (uint64_t)header.name_slot_count * sizeof(name_slot_t);
+    memcpy(header.magic, INDEX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    static const char padding[INDEX_SNAPSHOT_ALIGN];
+    bool written = fwrite(&header, sizeof(header), 1, snapshot) == 1 &&
+                   fwrite(padding, INDEX_SNAPSHOT_ALIGN - sizeof(header), 1, snapshot) == 1 &&
+                   fwrite(file_index.entries, sizeof(index_entry_t), file_index.count, snapshot) == file_index.count &&
+                   fwrite(file_index.names, 1, file_index.names_length, snapshot) == file_index.names_length &&
+                   fwrite(padding, 1, header.name_slots_offset - names_end, snapshot) == header.name_slots_offset - names_end &&
+                   fwrite(file_index.name_table.slots, sizeof(name_slot_t), header.name_slot_count, snapshot) == header.name_slot_count &&
+                   fwrite(file_index.extension_table.slots, sizeof(name_slot_t), header.extension_slot_count, snapshot) == header.extension_slot_count;
+    pthread_rwlock_unlock(&file_index.lock);
+
+    if (fclose(snapshot) != 0 || !written || rename(temporary, path) == -1) {
+        perror("Error: Failed to save the index snapshot");
+        unlink(temporary);
+    }
+}
+
+// Checks that a hash table of a snapshot only refers to strings and entries inside it
+bool snapshot_table_valid(const name_slot_t *slots, uint32_t slot_count, uint32_t used, const index_snapshot_header_t *header) {
+    if (slot_count <= used || (slot_count & (slot_count - 1)) != 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < slot_count; i++) {
+        const name_slot_t *slot = &slots[i];
+        if (slot->name != INDEX_NONE && (slot->name >= header->names_length || slot->first >= header->count || slot->last >= header->count)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Follows every chain of a name or extension table through the given links, each entry may be on one chain only.
+// Returns false if a chain runs in a loop or joins another one.
+bool snapshot_chains_valid(const index_entry_t *entries, const name_slot_t *slots, uint32_t slot_count,
+                           size_t link_offset, uint8_t *seen, uint8_t mark) {
+    for (uint32_t i = 0; i < slot_count; i++) {
+        if (slots[i].name == INDEX_NONE) {
+            continue;
+        }
+        uint32_t last = INDEX_NONE;
+        for (uint32_t id = slots[i].first; id != INDEX_NONE; id = *(const uint32_t *)((const char *)&entries[id] + link_offset)) {
+            if (seen[id] & mark) {
+                return false;
+            }
+            seen[id] |= mark;
+            last = id;
+        }
+        if (last != slots[i].last) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks that the child and sibling links of a snapshot form a tree under the root and that the name and
+// extension chains end, so no walk of the index can go round in circles
+bool snapshot_links_valid(const index_entry_t *entries, const index_snapshot_header_t *header,
+                          const name_slot_t *name_slots, const name_slot_t *extension_slots) {
+    enum { SEEN_TREE = 1, SEEN_NAME = 2, SEEN_EXTENSION = 4 };
+    uint8_t *seen = calloc(header->count, 1);
+    if (seen == NULL) {
+        return false;
+    }
+    bool valid = true;
+    seen[0] = SEEN_TREE;
+    for (uint32_t i = 0; valid && i < header->count; i++) {
+        if (entries[i].mode == 0) {
+            valid = entries[i].first_child == INDEX_NONE; // Removed entries keep no children
+            continue;
+        }
+        // Each entry is listed once, in the directory its parent link names
+        for (uint32_t child = entries[i].first_child; valid && child != INDEX_NONE; child = entries[child].next_sibling) {
+            valid = !(seen[child] & SEEN_TREE) && entries[child].parent == i;
+            seen[child] |= SEEN_TREE;
+        }
+    }
+    valid = valid &&
+            snapshot_chains_valid(entries, name_slots, header->name_slot_count, offsetof(index_entry_t, next_same_name), seen, SEEN_NAME) &&
+            snapshot_chains_valid(entries, extension_slots, header->extension_slot_count, offsetof(index_entry_t, next_same_extension), seen, SEEN_EXTENSION);
+    free(seen);
+    return valid;
+}
+
+// Maps the snapshot of a directory tree as the index. Returns false if there is none or it can't be
+// trusted, the caller then builds the index by walking the tree.
+bool index_load_snapshot(const char *path, const char *root) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    // The default path is in /tmp, a snapshot someone else wrote or could change is not trusted
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < INDEX_SNAPSHOT_ALIGN || !S_ISREG(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+        close(fd);
+        return false;
+    }
+    // Private mapping: entries updated later are copied by the kernel, the file itself never changes
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error: Failed to map the index snapshot");
+        return false;
+    }
+
+    const index_snapshot_header_t *header = (const index_snapshot_header_t *)map;
+    index_entry_t *entries = (index_entry_t *)(map + INDEX_SNAPSHOT_ALIGN);
+    char *names = (char *)(entries + header->count);
+    uint64_t names_end = INDEX_SNAPSHOT_ALIGN + (uint64_t)header->count * sizeof(index_entry_t) + header->names_length;
+    name_slot_t *name_slots = (name_slot_t *)(map + header->name_slots_offset);
+    name_slot_t *extension_slots = (name_slot_t *)(map + header->extension_slots_offset);
+    bool valid = memcmp(header->magic, INDEX_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == INDEX_SNAPSHOT_VERSION && header->entry_size == sizeof(index_entry_t) &&
+                 header->entries_offset == INDEX_SNAPSHOT_ALIGN && header->count > 0 && header->names_length > 0 &&
+                 header->name_slots_offset == ((names_end + 7) & ~(uint64_t)7) &&
+                 header->extension_slots_offset == header->name_slots_offset + (uint64_t)header->name_slot_count * sizeof(name_slot_t) &&
+                 (uint64_t)st.st_size == header->extension_slots_offset + (uint64_t)header->extension_slot_count * sizeof(name_slot_t) &&
+                 names[header->names_length - 1] == '\0' && entries[0].parent == INDEX_NONE &&
+                 snapshot_table_valid(name_slots, header->name_slot_count, header->distinct_names, header) &&
+                 snapshot_table_valid(extension_slots, header->extension_slot_count, header->distinct_extensions, header);
+    // Every link and name has to stay inside the snapshot, a damaged file must not crash the server
+    for (uint32_t i = 0; valid && i < header->count; i++) {
+        const index_entry_t *entry = &entries[i];
+        valid = (i == 0 || entry->parent < header->count) && entry->name + (uint64_t)entry->name_length < header->names_length &&
+                (entry->first_child == INDEX_NONE || entry->first_child < header->count) &&
+                (entry->next_sibling == INDEX_NONE || entry->next_sibling < header->count) &&
+                (entry->next_same_name == INDEX_NONE || entry->next_same_name < header->count) &&
+                (entry->next_same_extension == INDEX_NONE || entry->next_same_extension < header->count) &&
+                entry->extension <= entry->name_length;
+    }
+    valid = valid && strcmp(names + entries[0].name, root) == 0 &&
+            snapshot_links_valid(entries, header, name_slots, extension_slots);
+    if (!valid) {
+        fprintf(stderr, "Ignoring index snapshot %s, it is stale or damaged\n", path);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    file_index.snapshot = map;
+    file_index.snapshot_size = st.st_size;
+    file_index.entries = entries;
+    file_index.count = header->count;
+    file_index.capacity = header->count;
+    file_index.removed = header->removed;
+    file_index.names = names;
+    file_index.names_length = header->names_length;
+    file_index.names_capacity = header->names_length;
+    file_index.name_table = (name_table_t){name_slots, header->name_slot_count, header->distinct_names};
+    file_index.extension_table = (name_table_t){extension_slots, header->extension_slot_count, header->distinct_extensions};
+    pthread_rwlock_unlock(&file_index.lock);
+    return true;
+}
+
+// Changes to a file don't touch its directory, so index_recover() misses them and every file is checked once
+// against the disk, a batch at a time so queries aren't held up. Returns how many entries changed.
+uint32_t index_refresh_files(void) {
+    char path[MAX_PATH_LENGTH];
+    char name[NAME_MAX + 1];
+    struct stat st;
+    uint32_t next = 0, changed = 0;
+    bool more = true;
+    while (more) {
+        pthread_rwlock_wrlock(&file_index.lock);
+        for (uint32_t end = next + INDEX_REFRESH_BATCH; next < file_index.count && next < end; next++) {
+            index_entry_t *entry = &file_index.entries[next];
+            if (!S_ISREG(entry->mode)) {
+                continue;
+            }
+            index_path(next, path, sizeof(path));
+            if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+                snprintf(name, sizeof(name), "%s", file_index.names + entry->name);
+                index_refresh_child(entry->parent, name);
+                changed++;
+            } else if (st.st_size != entry->size || st.st_mtime != entry->mtime || st.st_ctime != entry->ctime || st.st_mode != entry->mode) {
+                index_set_stat(next, &st); // Only changed entries are written, the others stay shared
+                changed++;
+            }
+        }
+        more = next < file_index.count;
+        pthread_rwlock_unlock(&file_index.lock);
+    }
+    return changed;
+}
+
+// An acceptor that replaces one that died inherits the index of the parent, which has not followed the tree
+// since it forked the first acceptors, so it checks every file once in the background
+void *index_refresh_files_thread(void *arg) {
+    (void)arg;
+    index_refresh_files();
+    return NULL;
+}
+
+// Loads the index from its snapshot and catches up with the directories and files changed since it was saved,
+// or builds it from scratch if there is no usable snapshot. The snapshot is saved again whenever it was out of
+// date. This runs once in the parent, the acceptors inherit the result when they are forked.
+void load_index(const char *root) {
+    char path[MAX_PATH_LENGTH];
+    if (index_snapshot_path[0]) {
+        snprintf(path, sizeof(path), "%s", index_snapshot_path);
+    } else {
+        default_snapshot_path(root, path, sizeof(path));
+    }
+
+    long start_us = now_us();
+    if (!index_load_snapshot(path, root)) {
+        build_index(root);
+        index_save_snapshot(path);
+        return;
+    }
+    pthread_rwlock_wrlock(&file_index.lock);
+    int rescanned = index_recover();
+    pthread_rwlock_unlock(&file_index.lock);
+    uint32_t refreshed = index_refresh_files();
+    printf("Loaded %u index entries from %s in %ld ms, %d directories and %u files changed since\n",
+           file_index.count, path, (now_us() - start_us) / 1000, rescanned, refreshed);
+    if (rescanned > 0 || refreshed > 0) {
+        index_save_snapshot(path);
+    }
+}
+
+void index_apply_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        fprintf(stderr, "Index watcher missed events, rescanning changed directories\n");
+        index_recover();
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watch_capacity || watched_directories[event->wd] == INDEX_NONE) {
+        return;
+    }
+    uint32_t directory = watched_directories[event->wd];
+    if (event->mask & IN_IGNORED) {
+        watched_directories[event->wd] = INDEX_NONE; // The directory is gone
+        return;
+    }
+    if (!S_ISDIR(file_index.entries[directory].mode)) {
+        return; // Event queued before the directory was removed from the index
+    }
+
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    if (event->len > 0) {
+        index_refresh_child(directory, event->name);
+    }
+    // Creating, removing or renaming a name also changes the directory itself
+    index_path(directory, path, sizeof(path));
+    if (lstat(path, &st) == 0) {
+        index_set_stat(directory, &st);
+    }
+}
+
+void *index_watcher_thread(void *arg) {
+    (void)arg;
+    char buffer[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("Error: Failed to read index events");
+            pthread_rwlock_wrlock(&file_index.lock);
+            index_followed = false;
+            pthread_rwlock_unlock(&file_index.lock);
+            return NULL;
+        }
+
+        pthread_rwlock_wrlock(&file_index.lock);
+        for (char *next = buffer; next < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *)next;
+            index_apply_event(event);
+            next += sizeof(struct inotify_event) + event->len;
+        }
+        pthread_rwlock_unlock(&file_index.lock);
+    }
+    return NULL;
+}
+
+// Watches every directory of the index and catches up with what changed since it was built
+void start_index_watcher(void) {
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        perror("Error: Failed to start the index watcher, the index will not see changes");
+        return;
+    }
+
+    pthread_rwlock_wrlock(&file_index.lock);
+    for (uint32_t i = 0; i < file_index.count; i++) {
+        if (S_ISDIR(file_index.entries[i].mode)) {
+            index_watch_directory(i);
+        }
+    }
+    index_recover();
+    pthread_rwlock_unlock(&file_index.lock);
+
+    pthread_t thread;
+    index_followed = true;
+    if (pthread_create(&thread, NULL, index_watcher_thread, NULL) != 0) {
+        perror("Error: Failed to start the index watcher");
+        index_followed = false;
+        return;
+    }
+    pthread_detach(thread);
+    if (index_behind && pthread_create(&thread, NULL, index_refresh_files_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// Sends the details of the first file with the given name, like find_and_send_file() used to, or of every
+// file with that name if all is set. The files are found through the name hash table.
+void index_find_file(reply_t *reply, const char *filename, bool all) {
+    typedef struct {
+        char *directory;
+        struct stat st;
+    } found_file_t;
+    found_file_t *found = NULL;
+    size_t count = 0, capacity = 0;
+    size_t length = strlen(filename);
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    name_slot_t *slot = index_find_name(&file_index.name_table, filename, length, hash_name(filename, length));
+    for (uint32_t i = slot->name == INDEX_NONE ? INDEX_NONE : slot->first; i != INDEX_NONE; i = file_index.entries[i].next_same_name) {
+        index_entry_t *entry = &file_index.entries[i];
+        if (!S_ISREG(entry->mode)) {
+            continue; // A directory or a removed file
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            found = realloc(found, capacity * sizeof(found_file_t));
+        }
+        // The details are copied so the lock is not held while the reply is sent
+        char directory[MAX_PATH_LENGTH];
+        index_path(entry->parent, directory, sizeof(directory));
+        found[count].directory = strdup(directory);
+        memset(&found[count].st, 0, sizeof(struct stat));
+        found[count].st.st_size = entry->size;
+        found[count].st.st_mtime = entry->mtime;
+        found[count].st.st_mode = entry->mode;
+        count++;
+        if (!all) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        send_file_info(reply, found[i].directory, filename, &found[i].st);
+        free(found[i].directory);
+    }
+    free(found);
+    if (count == 0) {
+        char message[] = "File not found\n";
+        reply->status = STATUS_NOT_FOUND;
+        reply_send(reply, message, sizeof(message) - 1);
+    }
+}
+
+// Query of w24fp: a substring of the name, or a glob pattern that has to match the whole name
+typedef struct {
+    const char *pattern;
+    bool glob; // The pattern has *, ? or [ in it
+    bool ignore_case; // -i was given
+} pattern_query_t;
+
+uint32_t trigram_key(const char *text) {
+    return (uint32_t)tolower((unsigned char)text[0]) << 16 | (uint32_t)tolower((unsigned char)text[1]) << 8 |
+           (uint32_t)tolower((unsigned char)text[2]);
+}
+
+int compare_trigram_pairs(const void *a, const void *b) {
+    uint64_t pairA = *(const uint64_t *)a;
+    uint64_t pairB = *(const uint64_t *)b;
+    return (pairA > pairB) - (pairA < pairB);
+}
+
+// Builds the trigram index of every name in the pool. Called with the read lock and trigrams_lock held.
+void index_build_trigrams(void) {
+    // One (trigram, name) pair per position of every name, sorted and without duplicates
+    size_t pair_count = 0;
+    for (size_t offset = 0; offset < file_index.names_length;) {
+        size_t length = strlen(file_index.names + offset);
+        pair_count += length > 2 ? length - 2 : 0;
+        offset += length + 1;
+    }
+    uint64_t *pairs = malloc((pair_count ? pair_count : 1) * sizeof(uint64_t));
+    if (pairs == NULL) {
+        return; // Pattern searches check every name instead
+    }
+    pair_count = 0;
+    for (size_t offset = 0; offset < file_index.names_length;) {
+        const char *name = file_index.names + offset;
+        size_t length = strlen(name);
+        for (size_t i = 0; i + 2 < length; i++) {
+            pairs[pair_count++] = (uint64_t)trigram_key(name + i) << 32 | offset;
+        }
+        offset += length + 1;
+    }
+    qsort(pairs, pair_count, sizeof(uint64_t), compare_trigram_pairs);
+
+    free(file_index.trigram_keys);
+    free(file_index.trigram_offsets);
+    free(file_index.trigram_postings);
+    file_index.trigram_keys = malloc((pair_count + 1) * sizeof(uint32_t));
+    file_index.trigram_offsets = malloc((pair_count + 1) * sizeof(uint32_t));
+    file_index.trigram_postings = malloc((pair_count + 1) * sizeof(uint32_t));
+    if (file_index.trigram_keys == NULL || file_index.trigram_offsets == NULL || file_index.trigram_postings == NULL) {
+        fprintf(stderr, "Error: Out of memory while indexing\n");
+        exit(1);
+    }
+    uint32_t keys = 0, postings = 0;
+    for (size_t i = 0; i < pair_count; i++) {
+        if (i > 0 && pairs[i] == pairs[i - 1]) {
+            continue; // The trigram shows up twice in the same name
+        }
+        uint32_t key = pairs[i] >> 32;
+        if (keys == 0 || file_index.trigram_keys[keys - 1] != key) {
+            file_index.trigram_keys[keys] = key;
+            file_index.trigram_offsets[keys] = postings;
+            keys++;
+        }
+        file_index.trigram_postings[postings++] = (uint32_t)pairs[i];
+    }
+    file_index.trigram_offsets[keys] = postings;
+    file_index.trigram_count = keys;
+    file_index.trigram_names_length = file_index.names_length;
+    file_index.trigrams_ready = true;
+    free(pairs);
+}
+
+// Lists the trigrams every name matching the pattern has to contain: those of the whole pattern for a
+// substring, those of each literal run between wildcards for a glob. Returns how many were written.
+int pattern_trigrams(const pattern_query_t *query, uint32_t *keys, int max_keys) {
+    char run[MAX_PATH_LENGTH];
+    size_t run_length = 0;
+    int count = 0;
+    for (const char *c = query->pattern;; c++) {
+        bool literal = *c != '\0';
+        if (literal && query->glob) {
+            if (*c == '\\' && c[1] != '\0') {
+                c++; // An escaped character is literal
+            } else if (*c == '*' || *c == '?') {
+                literal = false;
+            } else if (*c == '[') {
+                // A bracket expression stands for one unknown character
+                const char *end = strchr(c + (c[1] == ']' ? 2 : 1), ']');
+                if (end) {
+                    c = end;
+                    literal = false;
+                }
+            }
+        }
+        if (literal && run_length < sizeof(run)) {
+            run[run_length++] = *c;
+            continue;
+        }
+        for (size_t i = 0; i + 2 < run_length && count < max_keys; i++) {
+            keys[count++] = trigram_key(run + i);
+        }
+        run_length = 0;
+        if (*c == '\0') {
+            return count;
+        }
+    }
+}
+
+bool pattern_match(const pattern_query_t *query, const char *name) {
+    if (query->glob) {
+        return fnmatch(query->pattern, name, query->ignore_case ? FNM_CASEFOLD : 0) == 0;
+    }
+    return (query->ignore_case ? strcasestr(name, query->pattern) : strstr(name, query->pattern)) != NULL;
+}
+
+// Finds the postings of a trigram, returns how many there are
+uint32_t trigram_postings(uint32_t key, const uint32_t **postings) {
+    uint32_t low = 0, high = file_index.trigram_count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (file_index.trigram_keys[middle] < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == file_index.trigram_count || file_index.trigram_keys[low] != key) {
+        return 0;
+    }
+    *postings = file_index.trigram_postings + file_index.trigram_offsets[low];
+    return file_index.trigram_offsets[low + 1] - file_index.trigram_offsets[low];
+}
+
+// Lists the names that may match a pattern: those holding all its trigrams. Called with the read lock and
+// trigrams_lock held. Returns the number of names, or -1 if every name has to be checked.
+long trigram_candidates(const pattern_query_t *query, uint32_t **candidates) {
+    uint32_t keys[MAX_PATTERN_TRIGRAMS];
+    int key_count = pattern_trigrams(query, keys, MAX_PATTERN_TRIGRAMS);
+    if (key_count == 0 || !file_index.trigrams_ready) {
+        return -1; // Too short to narrow anything down
+    }
+
+    // Start from the rarest trigram, then keep the names that also hold each of the others
+    const uint32_t *postings[MAX_PATTERN_TRIGRAMS] = {NULL};
+    uint32_t lengths[MAX_PATTERN_TRIGRAMS] = {0};
+    int rarest = 0;
+    for (int i = 0; i < key_count; i++) {
+        lengths[i] = trigram_postings(keys[i], &postings[i]);
+        if (lengths[i] == 0) {
+            *candidates = NULL;
+            return 0;
+        }
+        rarest = lengths[i] < lengths[rarest] ? i : rarest;
+    }
+    uint32_t *names = malloc(lengths[rarest] * sizeof(uint32_t));
+    if (names == NULL) {
+        return -1;
+    }
+    memcpy(names, postings[rarest], lengths[rarest] * sizeof(uint32_t));
+    long count = lengths[rarest];
+    for (int i = 0; i < key_count && count > 0; i++) {
+        if (i == rarest) {
+            continue;
+        }
+        long kept = 0;
+        uint32_t j = 0;
+        for (long k = 0; k < count; k++) {
+            while (j < lengths[i] && postings[i][j] < names[k]) {
+                j++;
+            }
+            if (j < lengths[i] && postings[i][j] == names[k]) {
+                names[kept++] = names[k];
+            }
+        }
+        count = kept;
+    }
+    *candidates = names;
+    return count;
+}
+
+// Appends the paths of the regular files with a name to a listing
+void pattern_list_files(const char *name, char **listing, size_t *length, size_t *capacity, long *matches) {
+    char path[MAX_PATH_LENGTH];
+    size_t name_length = strlen(name);
+    name_slot_t *slot = index_find_name(&file_index.name_table, name, name_length, hash_name(name, name_length));
+    for (uint32_t i = slot->name == INDEX_NONE ? INDEX_NONE : slot->first; i != INDEX_NONE; i = file_index.entries[i].next_same_name) {
+        if (!S_ISREG(file_index.entries[i].mode)) {
+            continue;
+        }
+        if (++*matches > MAX_PATTERN_MATCHES) {
+            continue; // Only counted
+        }
+        index_path(i, path, sizeof(path));
+        size_t path_length = strlen(path);
+        while (*length + path_length + 2 > *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 4096;
+            *listing = realloc(*listing, *capacity);
+            if (*listing == NULL) {
+                fprintf(stderr, "Error: Out of memory while listing files\n");
+                exit(1);
+            }
+        }
+        memcpy(*listing + *length, path, path_length);
+        (*listing)[*length + path_length] = '\n';
+        *length += path_length + 1;
+    }
+}
+
+// Lists the files whose name contains a substring or matches a glob pattern. The trigram index narrows the
+// names down to those that can match, only they are checked against the pattern.
+void index_find_pattern(reply_t *reply, const pattern_query_t *query) {
+    char *listing = NULL;
+    size_t length = 0, capacity = 0;
+    long matches = 0;
+
+    pthread_rwlock_rdlock(&file_index.lock);
+    pthread_mutex_lock(&file_index.trigrams_lock);
+    if (!file_index.trigrams_ready || file_index.names_length - file_index.trigram_names_length > TRIGRAM_MAX_UNINDEXED) {
+        index_build_trigrams();
+    }
+    uint32_t *candidates = NULL;
+    long count = trigram_candidates(query, &candidates);
+    size_t indexed = file_index.trigrams_ready ? file_index.trigram_names_length : 0;
+    // The candidates are a copy and the names are covered by the read lock, so other w24fp can go ahead
+    pthread_mutex_unlock(&file_index.trigrams_lock);
+    for (long i = 0; i < count; i++) {
+        const char *name = file_index.names + candidates[i];
+        if (pattern_match(query, name)) {
+            pattern_list_files(name, &listing, &length, &capacity, &matches);
+        }
+    }
+    // Every name when the pattern has no trigram, otherwise only those added since the index was built
+    for (size_t offset = count < 0 ? 0 : indexed; offset < file_index.names_length;) {
+        const char *name = file_index.names + offset;
+        if (pattern_match(query, name)) {
+            pattern_list_files(name, &listing, &length, &capacity, &matches);
+        }
+        offset += strlen(name) + 1;
+    }
+    pthread_rwlock_unlock(&file_index.lock);
+    free(candidates);
+
+    if (matches == 0) {
+        char message[] = "File not found\n";
+        reply->status = STATUS_NOT_FOUND;
+        reply_send(reply, message, sizeof(message) - 1);
+    } else {
+        reply_send(reply, listing, length);
+        if (matches > MAX_PATTERN_MATCHES) {
+            char message[100];
+            int message_length = snprintf(message, sizeof(message), "... and %ld more files, narrow the pattern down\n",
+                                          matches - MAX_PATTERN_MATCHES);
+            reply_send(reply, message, message_length);
+        }
+    }
+    free(listing);
+}
+
+// Query of w24ft. Every extension is looked up in the extension table. An extension with a dot of its own
+// (tar.gz) is looked up by its last part (gz), and the names found are checked for the whole suffix (.tar.gz).
+typedef struct {
+    int count; // Extensions asked for, without a leading '.' and without duplicates
+    const char *extensions[MAX_ARGS];
+    int suffix_count; // Extensions with a dot of their own, checked by suffix_match()
+    const char *suffixes[MAX_ARGS]; // The extension, the suffix is '.' followed by it
+    size_t suffix_lengths[MAX_ARGS]; // Length of the suffix, dot included
+    // Suffixes of up to SUFFIX_BLOCK bytes in groups of SUFFIX_LANES, laid out for the suffix kernel: bytes[g][k]
+    // holds byte k from the end of every suffix of group g, one lane each. any[g][k] is 0xFF in the lanes of
+    // suffixes shorter than k + 1, whose byte k matches anything. Unused lanes never match.
+    int group_count;
+    int group_lengths[SUFFIX_GROUPS]; // Longest suffix of each group
+    uint8_t bytes[SUFFIX_GROUPS][SUFFIX_BLOCK][SUFFIX_LANES] __attribute__((aligned(16)));
+    uint8_t any[SUFFIX_GROUPS][SUFFIX_BLOCK][SUFFIX_LANES] __attribute__((aligned(16)));
+} extension_query_t;
+
+// Reads the extensions of a w24ft command. The -u of the client (unzip the archive) is not an extension.
+void parse_extensions(char **args, int num_args, extension_query_t *query) {
+    memset(query, 0, sizeof(*query));
+    for (int i = 0; i < num_args; i++) {
+        const char *extension = args[i][0] == '.' ? args[i] + 1 : args[i];
+        bool repeated = false;
+        for (int j = 0; j < query->count; j++) {
+            repeated = repeated || strcmp(query->extensions[j], extension) == 0;
+        }
+        if (strcmp(args[i], "-u") == 0 || extension[0] == '\0' || repeated) {
+            continue;
+        }
+        query->extensions[query->count++] = extension;
+        if (strchr(extension, '.') == NULL) {
+            continue;
+        }
+
+        int n = query->suffix_count++;
+        size_t length = strlen(extension) + 1;
+        query->suffixes[n] = extension;
+        query->suffix_lengths[n] = length;
+        if (length > SUFFIX_BLOCK) {
+            continue;
+        }
+        int packed = 0; // Suffixes in the groups already
+        for (int j = 0; j < n; j++) {
+            packed += query->suffix_lengths[j] <= SUFFIX_BLOCK;
+        }
+        int group = packed / SUFFIX_LANES, lane = packed % SUFFIX_LANES;
+        query->group_count = group + 1;
+        if (query->group_lengths[group] < (int)length) {
+            query->group_lengths[group] = length;
+        }
+        for (size_t k = 0; k < SUFFIX_BLOCK; k++) {
+            if (k < length) {
+                query->bytes[group][k][lane] = k == length - 1 ? '.' : extension[length - 2 - k];
+            } else {
+                query->any[group][k][lane] = 0xFF;
+            }
+        }
+    }
+}
+
+// Tells whether a name ends with one of the suffixes of a query. With SSE2 a whole group of suffixes is
+// compared at once: each step broadcasts one byte of the name, counted from its end, and compares it with that
+// byte of every suffix of the group. The lanes that stay equal to the end of their suffix match, so the steps
+// depend on the length of the suffixes and not on how many there are.
+bool suffix_match(const extension_query_t *query, const char *name, size_t length) {
+#ifdef __SSE2__
+    uint8_t tail[SUFFIX_BLOCK] = {0}; // The last bytes of the name, backwards. Zeros never match a suffix byte.
+    for (size_t k = 0; k < SUFFIX_BLOCK && k < length; k++) {
+        tail[k] = name[length - 1 - k];
+    }
+    for (int group = 0; group < query->group_count; group++) {
+        __m128i matching = _mm_set1_epi8(-1);
+        for (int k = 0; k < query->group_lengths[group]; k++) {
+            __m128i equal = _mm_cmpeq_epi8(_mm_set1_epi8(tail[k]), _mm_load_si128((const __m128i *)query->bytes[group][k]));
+            matching = _mm_and_si128(matching, _mm_or_si128(equal, _mm_load_si128((const __m128i *)query->any[group][k])));
+            if (_mm_movemask_epi8(matching) == 0) {
+                break; // No suffix of the group is left
+            }
+        }
+        if (_mm_movemask_epi8(matching) != 0) {
+            return true;
+        }
+    }
+#endif
+    for (int i = 0; i < query->suffix_count; i++) {
+        size_t suffix_length = query->suffix_lengths[i];
+#ifdef __SSE2__
+        if (suffix_length <= SUFFIX_BLOCK) {
+            continue; // Compared above
+        }
+#endif
+        if (length >= suffix_length && name[length - suffix_length] == '.' &&
+            strcmp(name + length - suffix_length + 1, query->suffixes[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Query of the archive commands: the regular files that pass every filter. A range with INT64_MIN and INT64_MAX
+// does not filter anything, neither do NULL extensions. INDEX_QUERY_ALL selects every file.
+typedef struct {
+    int64_t low[INDEX_COLUMNS]; // Files with low <= key < high in each column are selected
+    int64_t high[INDEX_COLUMNS];
+    const extension_query_t *extensions; // Files with one of these extensions, NULL for any
+} index_query_t;
+
+#define INDEX_QUERY_ALL {.low = {[COLUMN_SIZE] = INT64_MIN, [COLUMN_MTIME] = INT64_MIN}, \
+                         .high = {[COLUMN_SIZE] = INT64_MAX, [COLUMN_MTIME] = INT64_MAX}, .extensions = NULL}
+
+int64_t column_key(const index_entry_t *entry, int column) {
+    return column == COLUMN_SIZE ? (int64_t)entry->size : (int64_t)entry->mtime;
+}
+
+bool column_filtered(const index_query_t *query, int column) {
+    return query->low[column] != INT64_MIN || query->high[column] != INT64_MAX;
+}
+
+// Tells whether a file is in every range of a query
+bool index_query_ranges(const index_query_t *query, const index_entry_t *entry) {
+    for (int column = 0; column < INDEX_COLUMNS; column++) {
+        int64_t key = column_key(entry, column);
+        if (key < query->low[column] || key >= query->high[column]) {
+            return false;
+        }
+    }
+    return S_ISREG(entry->mode);
+}
+
+// Tells whether a file has one of the extensions of a w24ft query
+bool extension_match(const extension_query_t *query, const index_entry_t *entry) {
+    if (entry->extension == 0) {
+        return false;
+    }
+    const char *name = file_index.names + entry->name;
+    for (int i = 0; i < query->count; i++) {
+        if (strcmp(query->extensions[i], name + entry->extension) == 0) {
+            return true;
+        }
+    }
+    return query->suffix_count > 0 && suffix_match(query, name, entry->name_length);
+}
+
+// Tells whether a query selects a file
+bool index_query_match(const index_query_t *query, const index_entry_t *entry) {
+    return index_query_ranges(query, entry) && (query->extensions == NULL || extension_match(query->extensions, entry));
+}
+
+typedef struct {
+    int64_t key;
+    uint32_t row;
+} column_cell_t;
+
+int compare_column_cells(const void *a, const void *b) {
+    const column_cell_t *cellA = a;
+    const column_cell_t *cellB = b;
+    if (cellA->key != cellB->key) {
+        return (cellA->key > cellB->key) - (cellA->key < cellB->key);
+    }
+    return (cellA->row > cellB->row) - (cellA->row < cellB->row);
+}
+
+// Sorts the columns of all regular files. Called with the read lock and columns_lock held.
+void index_build_columns(void) {
+    index_reset_columns();
+    column_cell_t *cells = malloc((file_index.count ? file_index.count : 1) * sizeof(column_cell_t));
+    if (cells == NULL) {
+        return; // Queries fall back to testing every file
+    }
+    for (int column = 0; column < INDEX_COLUMNS; column++) {
+        uint32_t length = 0;
+        for (uint32_t i = 0; i < file_index.count; i++) {
+            index_entry_t *entry = &file_index.entries[i];
+            if (entry->flags) {
+                entry->flags = 0; // Left over in a snapshot, written only when set so shared pages stay shared
+            }
+            if (S_ISREG(entry->mode)) {
+                cells[length].key = column_key(entry, column);
+                cells[length].row = i;
+                length++;
+            }
+        }
+        qsort(cells, length, sizeof(column_cell_t), compare_column_cells);
+
+        index_column_t *sorted = &file_index.columns[column];
+        sorted->keys = realloc(sorted->keys, (length ? length : 1) * sizeof(int64_t));
+        sorted->rows = realloc(sorted->rows, (length ? length : 1) * sizeof(uint32_t));
+        if (sorted->keys == NULL || sorted->rows == NULL) {
+            fprintf(stderr, "Error: Out of memory while sorting the index\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < length; i++) {
+            sorted->keys[i] = cells[i].key;
+            sorted->rows[i] = cells[i].row;
+        }
+        sorted->length = length;
+    }
+    free(cells);
+    file_index.columns_ready = true;
+}
+
+// First position of a column whose key is not below the given one
+uint32_t column_lower_bound(const index_column_t *column, int64_t key) {
+    uint32_t low = 0, high = column->length;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (column->keys[middle] < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int compare_rows(const void *a, const void *b) {
+    uint32_t rowA = *(const uint32_t *)a;
+    uint32_t rowB = *(const uint32_t *)b;
+    return (rowA > rowB) - (rowA < rowB);
+}
+
+// Lists the regular files with the extensions of a w24ft query. Called with the read lock held.
+long index_select_extensions(const extension_query_t *query, uint32_t **selected) {
+    uint32_t *rows = NULL;
+    long count = 0;
+    size_t capacity = 0;
+    for (int i = 0; i < query->count; i++) {
+        // The files of each last part are read once: all of them if it was asked for on its own,
+        // otherwise only those that end with one of the longer suffixes
+        const char *extension = query->extensions[i];
+        const char *last_part = strrchr(extension, '.') ? strrchr(extension, '.') + 1 : extension;
+        bool seen = false, whole = false;
+        for (int j = 0; j < query->count; j++) {
+            const char *other = query->extensions[j];
+            const char *other_last = strrchr(other, '.') ? strrchr(other, '.') + 1 : other;
+            seen = seen || (j < i && strcmp(other_last, last_part) == 0);
+            whole = whole || strcmp(other, last_part) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        size_t length = strlen(last_part);
+        name_slot_t *slot = index_find_name(&file_index.extension_table, last_part, length, hash_name(last_part, length));
+        for (uint32_t id = slot->name == INDEX_NONE ? INDEX_NONE : slot->first; id != INDEX_NONE; id = file_index.entries[id].next_same_extension) {
+            const index_entry_t *entry = &file_index.entries[id];
+            if (!S_ISREG(entry->mode) || (!whole && !suffix_match(query, file_index.names + entry->name, entry->name_length))) {
+                continue;
+            }
+            if ((size_t)count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                rows = realloc(rows, capacity * sizeof(uint32_t));
+                if (rows == NULL) {
+                    return -1;
+                }
+            }
+            rows[count++] = id;
+        }
+    }
+    *selected = rows;
+    return count;
+}
+
+// Lists the regular files a query selects, in index order. Called with the read lock held.
+// The files are found through the narrowest filter: the posting lists of the extensions, or the range of the
+// sorted column holding the fewest files. Every file found is then checked against the other filters, so
+// a query with several filters still takes one pass. Returns the number of files, -1 if out of memory.
+long index_select(const index_query_t *query, uint32_t **selected) {
+    uint32_t *rows = NULL;
+    long count = 0;
+    if (query->extensions != NULL) {
+        count = index_select_extensions(query->extensions, &rows);
+        long kept = 0;
+        for (long i = 0; i < count; i++) {
+            if (index_query_ranges(query, &file_index.entries[rows[i]])) {
+                rows[kept++] = rows[i];
+            }
+        }
+        count = count < 0 ? count : kept;
+    } else if (!column_filtered(query, COLUMN_SIZE) && !column_filtered(query, COLUMN_MTIME)) {
+        // Nothing to narrow it down, every file is checked
+        rows = malloc((file_index.count ? file_index.count : 1) * sizeof(uint32_t));
+        if (rows == NULL) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < file_index.count; i++) {
+            if (index_query_match(query, &file_index.entries[i])) {
+                rows[count++] = i;
+            }
+        }
+    } else {
+        pthread_mutex_lock(&file_index.columns_lock);
+        if (!file_index.columns_ready) {
+            index_build_columns();
+        }
+        if (!file_index.columns_ready) {
+            pthread_mutex_unlock(&file_index.columns_lock);
+            return -1;
+        }
+        // The range of the sorted column, and the files changed since it was sorted
+        uint32_t begin = 0, end = UINT32_MAX;
+        const index_column_t *column = NULL;
+        for (int c = 0; c < INDEX_COLUMNS; c++) {
+            const index_column_t *candidate = &file_index.columns[c];
+            uint32_t low = 0, high = 0;
+            if (!column_filtered(query, c)) {
+                continue;
+            } else if (query->low[c] < query->high[c]) {
+                low = column_lower_bound(candidate, query->low[c]);
+                high = column_lower_bound(candidate, query->high[c]);
+            }
+            if (column == NULL || high - low < end - begin) {
+                column = candidate;
+                begin = low;
+                end = high;
+            }
+        }
+        long most = (long)(end - begin) + file_index.changed_count; // Known before anything is archived
+        rows = malloc((most ? most : 1) * sizeof(uint32_t));
+        if (rows == NULL) {
+            pthread_mutex_unlock(&file_index.columns_lock);
+            return -1;
+        }
+        for (uint32_t i = begin; i < end; i++) {
+            const index_entry_t *entry = &file_index.entries[column->rows[i]];
+            // A changed file is looked at below with its current values, a removed one has mode 0
+            if (!(entry->flags & INDEX_CHANGED) && index_query_match(query, entry)) {
+                rows[count++] = column->rows[i];
+            }
+        }
+        for (uint32_t i = 0; i < file_index.changed_count; i++) {
+            if (index_query_match(query, &file_index.entries[file_index.changed[i]])) {
+                rows[count++] = file_index.changed[i];
+            }
+        }
+        pthread_mutex_unlock(&file_index.columns_lock);
+    }
+
+    // Archive in index order, the order of the walks this replaces
+    if (count > 0) {
+        qsort(rows, count, sizeof(uint32_t), compare_rows);
+    }
+    *selected = rows;
+    return count;
+}
+
+// Writes a tar.gz archive to the client while it is being built. The tar stream is cut into blocks that the
+// compression threads deflate at the same time, the way pigz does: every block is primed with the 32 KB before
+// it so the ratio stays close to that of one stream, and ends on a byte boundary (Z_SYNC_FLUSH) so the
+// compressed blocks join into one deflate stream. Their CRCs are joined with crc32_combine() for the gzip
+// trailer. The blocks are sent in order as soon as they are done, so the first bytes still leave as soon as
+// the first files are read, and nothing is written to disk. A framed request gets FRAME_ARCHIVE_PART frames,
+// sent under the connection's lock until the empty one that ends the archive.
+// Files deflate can't shrink (media, archives, or content that looks random) go into blocks of their own that
+// are stored, not compressed: they cost a copy instead of a full deflate pass and grow by a few bytes per block.
+// A stored archive (-s) is a plain tar: the headers and small files are gathered in a single block that is sent
+// as it is, and larger files go from the page cache to the socket with sendfile(), never copied through the server.
+typedef struct archive_writer archive_writer_t;
+
+typedef struct compress_block {
+    archive_writer_t *writer; // Archive the block belongs to
+    unsigned char in[COMPRESS_BLOCK]; // Part of the tar stream
+    size_t in_length;
+    unsigned char window[COMPRESS_WINDOW]; // End of the previous block
+    size_t window_length;
+    unsigned char out[COMPRESS_BOUND]; // Compressed block
+    size_t out_length;
+    int level; // Z_DEFAULT_COMPRESSION, or Z_NO_COMPRESSION for the contents of a file that can't be compressed
+    uint32_t crc; // CRC-32 of in
+    bool last; // Ends the deflate stream
+    bool done; // Compressed, protected by the writer's lock
+    bool failed; // deflate() did not take the whole block
+    struct compress_block *next; // Next block waiting for a compression thread
+} compress_block_t;
+
+struct archive_writer {
+    reply_t *reply;
+    bool store; // Plain tar, nothing is compressed
+    int cache_fd; // Where a copy of the archive is kept for the cache, -1 if it is not
+    size_t cache_size; // Bytes copied there
+    int level; // Compression level of the block being filled
+    bool failed; // The client went away, the rest of the archive is not built
+    compress_block_t *blocks; // Ring of blocks, being filled, being compressed or waiting to be sent
+    int block_count;
+    int head; // Oldest block not sent yet
+    int pending; // Blocks handed to the compression threads and not sent yet, the next one is being filled
+    uint32_t crc; // CRC-32 of the blocks sent so far
+    uint64_t length; // Uncompressed bytes of the blocks sent so far
+    pthread_mutex_t lock;
+    pthread_cond_t block_done; // Signalled when a block of this archive has been compressed
+};
+
+const unsigned char tar_zeros[2 * TAR_BLOCK]; // Padding, and the two empty blocks that end an archive
+
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the compression queue
+pthread_cond_t compress_ready = PTHREAD_COND_INITIALIZER; // Signalled when a block is queued
+compress_block_t *compress_head = NULL, *compress_tail = NULL; // FIFO of blocks waiting to be compressed
+int compress_threads = 1; // Compression threads of this acceptor, its share of the CPUs
+int acceptor_count = 1; // Acceptor processes forked, they split the CPUs between their compression pools
+size_t archive_cache_limit = ARCHIVE_CACHE_BYTES; // This acceptor's share of the archive cache, set with acceptor_count
+
+// Compresses blocks of any archive with a raw deflate stream of its own, reset between blocks
+void *compress_thread(void *arg) {
+    (void)arg;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int level = Z_DEFAULT_COMPRESSION;
+    if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Error: Failed to set up compression\n");
+        exit(1);
+    }
+    while (1) {
+        pthread_mutex_lock(&compress_lock);
+        while (compress_head == NULL) {
+            pthread_cond_wait(&compress_ready, &compress_lock);
+        }
+        compress_block_t *block = compress_head;
+        compress_head = block->next;
+        if (compress_head == NULL) {
+            compress_tail = NULL;
+        }
+        pthread_mutex_unlock(&compress_lock);
+
+        deflateReset(&stream);
+        if (block->level != level) {
+            level = block->level;
+            deflateParams(&stream, level, Z_DEFAULT_STRATEGY); // Nothing is pending right after a reset
+        }
+        if (block->window_length > 0) {
+            deflateSetDictionary(&stream, block->window, block->window_length);
+        }
+        stream.next_in = block->in;
+        stream.avail_in = block->in_length;
+        stream.next_out = block->out;
+        stream.avail_out = sizeof(block->out);
+        int result = deflate(&stream, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+        block->out_length = sizeof(block->out) - stream.avail_out;
+        block->failed = stream.avail_in > 0 || result != (block->last ? Z_STREAM_END : Z_OK);
+        block->crc = crc32(0, block->in, block->in_length);
+
+        archive_writer_t *writer = block->writer;
+        pthread_mutex_lock(&writer->lock);
+        block->done = true;
+        pthread_cond_broadcast(&writer->block_done);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+// Starts the compression threads, every acceptor runs its own pool so each gets an even share of the CPUs
+void start_compress_pool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN) / acceptor_count;
+    compress_threads = cpus < 1 ? 1 : cpus > COMPRESS_MAX_THREADS ? COMPRESS_MAX_THREADS : (int)cpus;
+    for (int i = 0; i < compress_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compress_thread, NULL) != 0) {
+            perror("Error: Failed to start compression thread");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Sends compressed bytes, an empty part only ends a framed archive
+void archive_send(archive_writer_t *writer, const void *data, size_t length) {
+    reply_t *reply = writer->reply;
+    if (writer->failed || (length == 0 && !reply->framed)) {
+        return;
+    }
+    if ((reply->framed && send_frame_header(reply->fd, FRAME_ARCHIVE_PART, STATUS_OK, reply->request_id, length) < 0) ||
+        send_all(reply->fd, data, length, 0) < 0) {
+        perror("Failed to send data");
+        writer->failed = true;
+    }
+    if (writer->cache_fd >= 0) {
+        // The copy is given up once the archive is too large to be cached
+        size_t cache_max = archive_cache_limit < ARCHIVE_CACHE_ENTRY_MAX ? archive_cache_limit : ARCHIVE_CACHE_ENTRY_MAX;
+        if (writer->cache_size + length > cache_max || write(writer->cache_fd, data, length) != (ssize_t)length) {
+            close(writer->cache_fd);
+            writer->cache_fd = -1;
+        }
+        writer->cache_size += length;
+    }
+}
+
+// Sends the oldest block once it has been compressed. With wait false it is only sent if it is done already.
+// Returns whether it was sent.
+bool archive_send_block(archive_writer_t *writer, bool wait) {
+    compress_block_t *block = &writer->blocks[writer->head];
+    pthread_mutex_lock(&writer->lock);
+    while (wait && !block->done) {
+        pthread_cond_wait(&writer->block_done, &writer->lock);
+    }
+    bool done = block->done;
+    pthread_mutex_unlock(&writer->lock);
+    if (!done) {
+        return false;
+    }
+    if (block->failed && !writer->failed) {
+        fprintf(stderr, "Error: Failed to compress the archive\n");
+        writer->failed = true;
+    }
+    archive_send(writer, block->out, block->out_length);
+    writer->crc = crc32_combine(writer->crc, block->crc, block->in_length);
+    writer->length += block->in_length;
+    writer->head = (writer->head + 1) % writer->block_count;
+    writer->pending--;
+    return true;
+}
+
+// Block being filled
+compress_block_t *archive_current(archive_writer_t *writer) {
+    return &writer->blocks[(writer->head + writer->pending) % writer->block_count];
+}
+
+// Hands the block being filled to the compression threads and starts the next one.
+// A stored archive sends it right away instead.
+void archive_submit(archive_writer_t *writer, bool last) {
+    compress_block_t *block = archive_current(writer);
+    if (writer->store) {
+        archive_send(writer, block->in, block->in_length);
+        block->in_length = 0;
+        return;
+    }
+    compress_block_t *previous = &writer->blocks[(writer->head + writer->pending + writer->block_count - 1) % writer->block_count];
+    // Every block but the first can refer back to the end of the one before it, which has not been reused yet
+    block->window_length = 0;
+    if (writer->pending > 0 || writer->length > 0) {
+        block->window_length = previous->in_length < COMPRESS_WINDOW ? previous->in_length : COMPRESS_WINDOW;
+        memcpy(block->window, previous->in + previous->in_length - block->window_length, block->window_length);
+    }
+    block->level = writer->level;
+    block->last = last;
+    block->done = false;
+    block->next = NULL;
+
+    pthread_mutex_lock(&compress_lock);
+    if (compress_tail) {
+        compress_tail->next = block;
+    } else {
+        compress_head = block;
+    }
+    compress_tail = block;
+    pthread_cond_signal(&compress_ready);
+    pthread_mutex_unlock(&compress_lock);
+    writer->pending++;
+
+    // Send what is ready, and make room for the next block if every one of them is taken
+    while (writer->pending > 0 && archive_send_block(writer, writer->pending == writer->block_count)) {
+    }
+    archive_current(writer)->in_length = 0;
+}
+
+// Makes room in the block being filled, returns where the next bytes go and how many fit
+unsigned char *archive_space(archive_writer_t *writer, size_t *space) {
+    compress_block_t *block = archive_current(writer);
+    if (block->in_length == COMPRESS_BLOCK) {
+        archive_submit(writer, false);
+        block = archive_current(writer);
+    }
+    *space = COMPRESS_BLOCK - block->in_length;
+    return block->in + block->in_length;
+}
+
+// Adds bytes to the archive
+void archive_write(archive_writer_t *writer, const void *data, size_t length) {
+    const unsigned char *next = data;
+    while (length > 0) {
+        size_t space;
+        unsigned char *free_space = archive_space(writer, &space);
+        size_t copied = length < space ? length : space;
+        memcpy(free_space, next, copied);
+        archive_current(writer)->in_length += copied;
+        next += copied;
+        length -= copied;
+    }
+}
+
+// Writes a number into a header field as octal digits, or base-256 if it is too big for them (GNU tar)
+void tar_number(char *field, size_t size, uint64_t value) {
+    if (value < (uint64_t)1 << (3 * (size - 1))) {
+        char digits[24];
+        snprintf(digits, sizeof(digits), "%0*llo", (int)size - 1, (unsigned long long)value);
+        memcpy(field, digits, size - 1);
+        return;
+    }
+    for (size_t i = size - 1; i > 0; i--, value >>= 8) {
+        field[i] = value & 0xff;
+    }
+    field[0] = (char)0x80;
+}
+
+// Adds a GNU tar header, st is NULL for the entry holding a long name
+void archive_header(archive_writer_t *writer, const char *name, char type, uint64_t size, const struct stat *st) {
+    char header[TAR_BLOCK];
+    memset(header, 0, sizeof(header));
+    size_t name_length = strlen(name);
+    memcpy(header, name, name_length < 100 ? name_length : 100);
+    tar_number(header + 100, 8, st ? st->st_mode & 07777 : 0);
+    tar_number(header + 108, 8, st ? st->st_uid : 0);
+    tar_number(header + 116, 8, st ? st->st_gid : 0);
+    tar_number(header + 124, 12, size);
+    tar_number(header + 136, 12, st ? (uint64_t)st->st_mtime : 0);
+    header[156] = type;
+    memcpy(header + 257, "ustar  ", 8); // GNU format, as tar -czf writes by default
+    memset(header + 148, ' ', 8); // The checksum is computed with its own field as spaces
+    unsigned checksum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+    archive_write(writer, header, sizeof(header));
+}
+
+// Sends a file from its start with sendfile() on a non-blocking socket. Returns the bytes sent,
+// less than length if the file is shorter, or -1 if the client is gone.
+int64_t sendfile_all(int socket_fd, int fd, uint64_t length) {
+    off_t offset = 0;
+    while ((uint64_t)offset < length) {
+        ssize_t sent = sendfile(socket_fd, fd, &offset, length - offset);
+        if (sent == 0) {
+            break; // End of the file
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_writable(socket_fd) < 0) {
+                return -1;
+            }
+        } else if (sent < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return offset;
+}
+
+// Sends the contents of a file with sendfile() for a stored archive, as a part of its own for a framed request.
+// Returns the bytes sent, less than length if the file shrank.
+uint64_t archive_sendfile(archive_writer_t *writer, int fd, uint64_t length) {
+    reply_t *reply = writer->reply;
+    if (reply->framed && send_frame_header(reply->fd, FRAME_ARCHIVE_PART, STATUS_OK, reply->request_id, length) < 0) {
+        writer->failed = true;
+        return length;
+    }
+    int64_t sent = sendfile_all(reply->fd, fd, length);
+    if (sent < 0) {
+        perror("Failed to send data");
+        writer->failed = true;
+        return length;
+    }
+    return sent;
+}
+
+// Ends the block being filled early so the next bytes are compressed at another level
+void archive_set_level(archive_writer_t *writer, int level) {
+    if (level != writer->level && archive_current(writer)->in_length > 0) {
+        archive_submit(writer, false);
+    }
+    writer->level = level;
+}
+
+// Tells whether deflate is unlikely to shrink a file: its extension is that of a compressed format, or the
+// bytes at its start look random. The sample passes when its collision entropy, -log2 of the chance that two
+// bytes picked at random are equal, is above 7.5 bits per byte, which needs no floating point: sum(c^2) / n^2
+// has to stay below 2^-7.5, about 1/181. Text stays under 5 bits per byte, base64 under 6.
+bool incompressible(const char *name, int fd) {
+    static const char *compressed[] = {
+        "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "aac", "ogg", "opus", "flac", "mp4", "m4a", "m4v", "mkv",
+        "mov", "avi", "webm", "zip", "gz", "tgz", "bz2", "xz", "zst", "lz4", "7z", "rar", "jar", "apk", "docx",
+        "xlsx", "pptx", "odt", "woff", "woff2",
+    };
+    const char *dot = strrchr(name, '.');
+    for (size_t i = 0; dot && i < sizeof(compressed) / sizeof(compressed[0]); i++) {
+        if (strcasecmp(dot + 1, compressed[i]) == 0) {
+            return true;
+        }
+    }
+
+    unsigned char sample[ENTROPY_SAMPLE];
+    ssize_t length = pread(fd, sample, sizeof(sample), 0); // The pages are read again right after, from the cache
+    if (length < (ssize_t)sizeof(sample)) {
+        return false;
+    }
+    uint32_t counts[256] = {0};
+    for (ssize_t i = 0; i < length; i++) {
+        counts[sample[i]]++;
+    }
+    uint64_t collisions = 0;
+    for (int i = 0; i < 256; i++) {
+        collisions += (uint64_t)counts[i] * counts[i];
+    }
+    return collisions * 181 < (uint64_t)length * length;
+}
+
+// Adds a file to the archive under its path without the leading '/', like tar does. A file that can't be
+// read is left out, one that shrank while it was read is padded with zeros to the size in its header.
+void archive_add_file(archive_writer_t *writer, const char *path) {
+    // The file may have been replaced since it was indexed. A symlink is not followed out of the home directory,
+    // and a FIFO is opened without waiting for a writer, fstat() then leaves it out.
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Leaving %s out of the archive: %s\n", path, fd == -1 ? strerror(errno) : "not a regular file");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    const char *name = path + strspn(path, "/");
+    size_t name_length = strlen(name);
+    if (name_length >= 100) {
+        // Too long for the header, the whole name goes in an entry of its own before it
+        archive_header(writer, "././@LongLink", 'L', name_length + 1, NULL);
+        archive_write(writer, name, name_length + 1);
+        archive_write(writer, tar_zeros, (TAR_BLOCK - (name_length + 1) % TAR_BLOCK) % TAR_BLOCK);
+    }
+    archive_header(writer, name, '0', st.st_size, &st);
+
+    // Read straight into the block being filled, or sent straight from the file
+    uint64_t left = st.st_size;
+    bool raw = !writer->store && left >= RAW_MIN && incompressible(name, fd);
+    if (raw) {
+        archive_set_level(writer, Z_NO_COMPRESSION);
+    }
+    if (writer->store && left >= SENDFILE_MIN) {
+        archive_submit(writer, false); // The headers go first
+        left -= archive_sendfile(writer, fd, left);
+        if (left > 0 && !writer->failed) {
+            // The part of a framed request is already announced with the full size, so the rest goes in it too
+            fprintf(stderr, "%s shrank while it was archived\n", path);
+            for (; left > 0 && !writer->failed; left -= left < sizeof(tar_zeros) ? left : sizeof(tar_zeros)) {
+                if (send_all(writer->reply->fd, tar_zeros, left < sizeof(tar_zeros) ? left : sizeof(tar_zeros), 0) < 0) {
+                    writer->failed = true;
+                }
+            }
+        }
+    }
+    while (left > 0 && !writer->failed) {
+        size_t space;
+        unsigned char *free_space = archive_space(writer, &space);
+        size_t wanted = left < space ? left : space;
+        ssize_t got = read(fd, free_space, wanted);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            fprintf(stderr, "%s shrank while it was archived\n", path);
+            memset(free_space, 0, wanted);
+            got = wanted;
+        }
+        archive_current(writer)->in_length += got;
+        left -= got;
+    }
+    if (raw) {
+        archive_set_level(writer, Z_DEFAULT_COMPRESSION);
+    }
+    archive_write(writer, tar_zeros, (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK);
+    close(fd);
+}
+
+// Streams a tar.gz of a null-separated list of files to the client, or a plain tar if store is set.
+// A copy is written to *cache_fd unless it is -1, or set to -1 if the archive turned out too large for it.
+// Returns false if the archive could not be started, or the client went away before the end of it.
+bool send_archive(reply_t *reply, const char *list, size_t list_length, bool store, int *cache_fd) {
+    archive_writer_t *writer = calloc(1, sizeof(archive_writer_t));
+    // Enough blocks to keep every compression thread busy while the finished ones wait to be sent, up to a
+    // limit so the archives built at the same time don't each take a few MB
+    int block_count = store ? 1 : 2 * compress_threads;
+    if (block_count > COMPRESS_MAX_BLOCKS) {
+        block_count = COMPRESS_MAX_BLOCKS;
+    }
+    compress_block_t *blocks = malloc(block_count * sizeof(compress_block_t));
+    if (writer == NULL || blocks == NULL || reply->sent) {
+        free(writer);
+        free(blocks);
+        return false;
+    }
+    writer->reply = reply;
+    writer->store = store;
+    writer->cache_fd = *cache_fd;
+    writer->level = Z_DEFAULT_COMPRESSION;
+    writer->blocks = blocks;
+    writer->block_count = block_count;
+    writer->crc = crc32(0, NULL, 0);
+    for (int i = 0; i < block_count; i++) {
+        blocks[i].writer = writer;
+        blocks[i].in_length = 0;
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->block_done, NULL);
+    reply->sent = reply->framed; // Whatever happens next, the client can't be sent another frame for this request
+    pthread_mutex_lock(reply->write_lock); // The parts go out back to back, other replies wait
+
+    // gzip header: deflate, no name, no time, made on Unix
+    static const unsigned char gzip_header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    if (!store) {
+        archive_send(writer, gzip_header, sizeof(gzip_header));
+    }
+    for (size_t offset = 0; offset < list_length && !writer->failed; offset += strlen(list + offset) + 1) {
+        archive_add_file(writer, list + offset);
+    }
+    archive_write(writer, tar_zeros, sizeof(tar_zeros));
+    archive_submit(writer, true);
+    while (writer->pending > 0) {
+        archive_send_block(writer, true); // Also when the client is gone, the threads still use the blocks
+    }
+    // gzip trailer: CRC-32 and length of the tar stream, little-endian
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = writer->crc >> (8 * i);
+        trailer[4 + i] = writer->length >> (8 * i);
+    }
+    if (!store) {
+        archive_send(writer, trailer, sizeof(trailer));
+    }
+    archive_send(writer, NULL, 0);
+
+    pthread_mutex_unlock(reply->write_lock);
+    bool sent = !writer->failed;
+    *cache_fd = writer->cache_fd;
+    pthread_cond_destroy(&writer->block_done);
+    pthread_mutex_destroy(&writer->lock);
+    free(blocks);
+    free(writer);
+    return sent;
+}
+
+// Compressed archives already sent, kept in memory files (memfd) so they can be sent again with sendfile().
+// An archive is found by its query and a fingerprint of the files it holds: their paths, sizes, modification
+// and status change times. Any file added, removed, replaced or written to changes the fingerprint, so a
+// stale archive is never found. The least recently used archives make room for new ones. Stored archives
+// (-s) are not cached, they are sent from the page cache already.
+typedef struct archive_cache_entry {
+    char *query; // The normalized query, see archive_cache_query()
+    uint64_t fingerprint; // Of the files in the archive
+    int fd; // Memory file holding the archive
+    size_t size;
+    unsigned long last_used; // archive_cache_clock when it was last found
+    int users; // Workers sending it right now
+    bool evicted; // No longer in the cache, freed by its last user
+    struct archive_cache_entry *next;
+} archive_cache_entry_t;
+
+pthread_mutex_t archive_cache_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the cache and its entries
+archive_cache_entry_t *archive_cache = NULL;
+size_t archive_cache_bytes = 0; // Size of the archives in the cache
+unsigned long archive_cache_clock = 0; // Bumped every time an archive is looked for
+
+// FNV-1a, 64 bits, for the fingerprints of archives
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Writes a query the same way whatever order its extensions were given in
+void archive_cache_query(const index_query_t *query, char *text, size_t size) {
+    int length = snprintf(text, size, "size %lld %lld mtime %lld %lld", (long long)query->low[COLUMN_SIZE],
+                          (long long)query->high[COLUMN_SIZE], (long long)query->low[COLUMN_MTIME],
+                          (long long)query->high[COLUMN_MTIME]);
+    if (query->extensions != NULL) {
+        const char *extensions[MAX_ARGS];
+        memcpy(extensions, query->extensions->extensions, query->extensions->count * sizeof(const char *));
+        qsort(extensions, query->extensions->count, sizeof(const char *), compare_strings);
+        for (int i = 0; i < query->extensions->count && length < (int)size; i++) {
+            length += snprintf(text + length, size - length, " .%s", extensions[i]);
+        }
+    }
+}
+
+// Takes an archive out of the cache. Called with archive_cache_lock held.
+void archive_cache_evict(archive_cache_entry_t *entry) {
+    for (archive_cache_entry_t **link = &archive_cache; *link != NULL; link = &(*link)->next) {
+        if (*link == entry) {
+            *link = entry->next;
+            break;
+        }
+    }
+    archive_cache_bytes -= entry->size;
+    entry->evicted = true;
+    if (entry->users == 0) {
+        close(entry->fd);
+        free(entry->query);
+        free(entry);
+    }
+}
+
+// Finds the archive of a query and its files, or NULL. The archive is kept until archive_cache_release().
+// An archive of the same query with other files is stale, it is dropped.
+archive_cache_entry_t *archive_cache_find(const char *query, uint64_t fingerprint) {
+    pthread_mutex_lock(&archive_cache_lock);
+    archive_cache_clock++;
+    archive_cache_entry_t *found = NULL;
+    for (archive_cache_entry_t *entry = archive_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->query, query) == 0) {
+            found = entry;
+            break;
+        }
+    }
+    if (found && found->fingerprint != fingerprint) {
+        archive_cache_evict(found);
+        found = NULL;
+    } else if (found) {
+        found->users++;
+        found->last_used = archive_cache_clock;
+    }
+    pthread_mutex_unlock(&archive_cache_lock);
+    return found;
+}
+
+void archive_cache_release(archive_cache_entry_t *entry) {
+    pthread_mutex_lock(&archive_cache_lock);
+    entry->users--;
+    if (entry->evicted && entry->users == 0) {
+        close(entry->fd);
+        free(entry->query);
+        free(entry);
+    }
+    pthread_mutex_unlock(&archive_cache_lock);
+}
+
+// Adds an archive to the cache, which takes over fd. The least recently used archives are dropped to make room.
+void archive_cache_add(const char *query, uint64_t fingerprint, int fd, size_t size) {
+    archive_cache_entry_t *added = malloc(sizeof(archive_cache_entry_t));
+    char *query_copy = strdup(query);
+    if (added == NULL || query_copy == NULL) {
+        free(added);
+        free(query_copy);
+        close(fd);
+        return;
+    }
+    *added = (archive_cache_entry_t){.query = query_copy, .fingerprint = fingerprint, .fd = fd, .size = size};
+
+    pthread_mutex_lock(&archive_cache_lock);
+    for (archive_cache_entry_t *entry = archive_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->query, query) == 0) {
+            archive_cache_evict(entry); // Built at the same time by another worker, or stale
+            break;
+        }
+    }
+    while (archive_cache != NULL && archive_cache_bytes + size > archive_cache_limit) {
+        archive_cache_entry_t *oldest = archive_cache;
+        for (archive_cache_entry_t *entry = archive_cache; entry != NULL; entry = entry->next) {
+            oldest = entry->last_used < oldest->last_used ? entry : oldest;
+        }
+        archive_cache_evict(oldest);
+    }
+    added->last_used = archive_cache_clock;
+    added->next = archive_cache;
+    archive_cache = added;
+    archive_cache_bytes += size;
+    pthread_mutex_unlock(&archive_cache_lock);
+}
+
+// Sends a cached archive with sendfile(), a framed request gets it as one archive frame of known size
+bool send_cached_archive(reply_t *reply, const archive_cache_entry_t *entry) {
+    if (reply->sent) {
+        return false;
+    }
+    reply->sent = reply->framed; // Whatever happens next, the client can't be sent another frame for this request
+    pthread_mutex_lock(reply->write_lock);
+    bool sent = (!reply->framed || send_frame_header(reply->fd, FRAME_ARCHIVE, STATUS_OK, reply->request_id, entry->size) == 0) &&
+                sendfile_all(reply->fd, entry->fd, entry->size) == (int64_t)entry->size;
+    pthread_mutex_unlock(reply->write_lock);
+    return sent;
+}
+
+// Archives every regular file the query selects and sends the archive, or "No file found" if there is none.
+// store sends a plain tar instead of a tar.gz. A tar.gz sent before for the same query and files is sent again
+// from the cache.
+void index_archive(reply_t *reply, const index_query_t *query, bool store) {
+    uint32_t *rows = NULL;
+    pthread_rwlock_rdlock(&file_index.lock);
+    long matches = index_select(query, &rows);
+    if (matches <= 0) {
+        pthread_rwlock_unlock(&file_index.lock);
+        free(rows);
+        if (matches == 0) {
+            const char* message = "No file found\n";
+            reply->status = STATUS_NOT_FOUND;
+            reply_send(reply, message, strlen(message));
+        } else {
+            reply->status = STATUS_ERROR;
+            reply_send(reply, "Server error: could not generate file list.\n", 45);
+        }
+        return;
+    }
+
+    // The list of files, null-separated so any file name works. Built first so the index is not locked while
+    // the files are archived.
+    char *list = NULL;
+    size_t list_length = 0, list_capacity = 0;
+    char path[MAX_PATH_LENGTH];
+    uint64_t fingerprint = 14695981039346656037ull;
+    // Files changed within the last second may change again without their times changing, the same second
+    // rule as directory_changed(). An archive holding one of them is not cached.
+    bool racy = false;
+    time_t racy_after = time(NULL) - 1;
+    for (long i = 0; i < matches; i++) {
+        const index_entry_t *entry = &file_index.entries[rows[i]];
+        index_path(rows[i], path, sizeof(path));
+        size_t path_length = strlen(path) + 1;
+        fingerprint = hash_bytes(fingerprint, path, path_length);
+        fingerprint = hash_bytes(fingerprint, &entry->size, sizeof(entry->size));
+        fingerprint = hash_bytes(fingerprint, &entry->mtime, sizeof(entry->mtime));
+        fingerprint = hash_bytes(fingerprint, &entry->ctime, sizeof(entry->ctime));
+        racy = racy || entry->mtime >= racy_after || entry->ctime >= racy_after;
+        while (list_length + path_length > list_capacity) {
+            list_capacity = list_capacity ? list_capacity * 2 : 65536;
+            list = realloc(list, list_capacity);
+            if (list == NULL) {
+                fprintf(stderr, "Error: Out of memory while listing files\n");
+                exit(1);
+            }
+        }
+        memcpy(list + list_length, path, path_length);
+        list_length += path_length;
+    }
+    // The fingerprint comes from the index, it only proves an archive fresh while the index sees every change
+    bool cacheable = !store && !racy && index_followed && !out_of_watches;
+    pthread_rwlock_unlock(&file_index.lock);
+    free(rows);
+
+    char cache_query[CLIENT_MESSAGE_SIZE + 100];
+    archive_cache_query(query, cache_query, sizeof(cache_query));
+    archive_cache_entry_t *cached = cacheable ? archive_cache_find(cache_query, fingerprint) : NULL;
+    if (cached != NULL) {
+        if (send_cached_archive(reply, cached)) {
+            printf("Archive of %ld files sent from the cache\n", matches);
+        } else {
+            fprintf(stderr, "Failed to send the archive to the client\n");
+        }
+        archive_cache_release(cached);
+        free(list);
+        return;
+    }
+
+    int cache_fd = cacheable ? memfd_create("w24archive", MFD_CLOEXEC) : -1;
+    if (send_archive(reply, list, list_length, store, &cache_fd)) {
+        printf("Archive of %ld files sent\n", matches);
+        if (cache_fd >= 0) {
+            archive_cache_add(cache_query, fingerprint, cache_fd, lseek(cache_fd, 0, SEEK_CUR));
+            cache_fd = -1;
+        }
+    } else if (!reply->sent) {
+        fprintf(stderr, "Failed to create tar archive.\n");
+        const char* message = "Error creating file archive\n";
+        reply->status = STATUS_ERROR;
+        reply_send(reply, message, strlen(message));
+    } else {
+        fprintf(stderr, "Failed to send the archive to the client\n");
+    }
+    if (cache_fd >= 0) {
+        close(cache_fd);
+    }
+    free(list);
+}
+
+// Reads a YYYY-MM-DD date as midnight local time, the way find -newermt does
+bool parse_date(const char *date, time_t *result) {
+    struct tm date_tm;
+    memset(&date_tm, 0, sizeof(date_tm));
+    const char *end = strptime(date, "%Y-%m-%d", &date_tm);
+    if (end == NULL || *end != '\0') {
+        return false;
+    }
+    date_tm.tm_isdst = -1;
+    *result = mktime(&date_tm);
+    return *result != -1;
+}
+
+// Runs a single command received from the client, returns -1 when the connection should be closed
+int crequest(reply_t *reply, const char *client_message)
+{
+    char *args[MAX_ARGS];
+    char *saveptr; // strtok_r state, strtok is not safe with several workers
+    int num_args;
+
+    printf("\nClient message: %s", client_message);
+    char temp[CLIENT_MESSAGE_SIZE];
+    snprintf(temp, sizeof(temp), "%s", client_message);
+    // break raw command
+    num_args = 0;
+    args[num_args] = strtok_r(temp, " \n", &saveptr);
+    while (args[num_args] != NULL && num_args < MAX_ARGS - 1)
+    {
+        num_args++;
+        args[num_args] = strtok_r(NULL, " \n", &saveptr);
+    }
+    if (args[0] == NULL)
+    {
+        reply->status = STATUS_BAD_REQUEST;
+        return 0; // Ignore empty lines
+    }
+
+    // "-s" after an archive command asks for a plain tar, stored without compression
+    bool store = false;
+    if (strcmp(args[0], "w24fz") == 0 || strcmp(args[0], "w24ft") == 0 || strcmp(args[0], "w24fdb") == 0 ||
+        strcmp(args[0], "w24fda") == 0)
+    {
+        int kept = 1;
+        for (int i = 1; i < num_args; i++)
+        {
+            if (strcmp(args[i], "-s") == 0)
+            {
+                store = true;
+            }
+            else
+            {
+                args[kept++] = args[i];
+            }
+        }
+        num_args = kept;
+        args[num_args] = NULL;
+    }
+
+    // commands
+    char message[1000];
+    if (strcmp(args[0], "w24fn") == 0 && num_args >= 2)
+    {
+        printf("Find Files Function Invoked\n");
+        // "w24fn name -a" lists every file with that name instead of the first one
+        index_find_file(reply, args[1], num_args >= 3 && strcmp(args[2], "-a") == 0);
+    }
+    else if (strcmp(args[0], "w24fp") == 0 && num_args >= 2)
+    {
+        printf("Find Files By Pattern Function Invoked\n");
+        // "w24fp text" finds names containing text, "w24fp a*.txt" names matching a glob, -i ignores case.
+        // The pattern is taken as typed, no shell expands it and quotes would be part of it.
+        pattern_query_t query = {.pattern = args[1], .glob = strpbrk(args[1], "*?[") != NULL,
+                                 .ignore_case = num_args >= 3 && strcmp(args[2], "-i") == 0};
+        index_find_pattern(reply, &query);
+    }
+    else if (strcmp(args[0], "w24fz") == 0)
+    {
+        if (num_args < 3) {
+            printf("Usage: w24fz size1 size2\n");
+            reply->status = STATUS_BAD_REQUEST;
+            return 0;
+        }
+        printf("File Search Function Invoked\n");
+        // Like find -size +size1c -size -size2c: larger than size1 and smaller than size2
+        index_query_t query = INDEX_QUERY_ALL;
+        query.low[COLUMN_SIZE] = (int64_t)atol(args[1]) + 1;
+        query.high[COLUMN_SIZE] = atol(args[2]);
+
+        // index_archive() sends the archive or "No file found"
+        index_archive(reply, &query, store);
+    }
+    else if (strcmp(args[0], "w24ft") == 0)
+    {
+        printf("Generate TAR Files Function Invoked\n");
+        extension_query_t *extensions = malloc(sizeof(extension_query_t));
+        if (extensions == NULL)
+        {
+            reply->status = STATUS_ERROR;
+            return 0;
+        }
+        parse_extensions(args + 1, num_args - 1, extensions);
+
+        index_query_t query = INDEX_QUERY_ALL;
+        query.extensions = extensions;
+        index_archive(reply, &query, store);
+        free(extensions);
+    }
+    else if (strcmp(args[0], "w24fdb") == 0) {
+        if (num_args != 2) {
+            printf("Usage: w24fdb date\n");
+            reply->status = STATUS_BAD_REQUEST;
+        } else {
+            printf("Search Before Date Function Invoked\n");
+            time_t date;
+            if (parse_date(args[1], &date)) {
+                // Like find ! -newermt date: modified at or before the date
+                index_query_t query = INDEX_QUERY_ALL;
+                query.high[COLUMN_MTIME] = (int64_t)date + 1;
+                index_archive(reply, &query, store);
+            } else {
+                reply->status = STATUS_BAD_REQUEST;
+                reply_send(reply, "Invalid date format: YYYY-MM-DD\n", 32);
+            }
+        }
+    }
+    else if (strcmp(args[0], "w24fda") == 0) {
+        if (num_args != 2) {
+            printf("Usage: w24fda date\n");
+            reply->status = STATUS_BAD_REQUEST;
+        } else {
+            printf("Search After Date Function Invoked\n");
+            time_t date;
+            if (parse_date(args[1], &date)) {
+                // Like find -newermt date: modified after the date
+                index_query_t query = INDEX_QUERY_ALL;
+                query.low[COLUMN_MTIME] = (int64_t)date + 1;
+                index_archive(reply, &query, store);
+            } else {
+                reply->status = STATUS_BAD_REQUEST;
+                reply_send(reply, "Invalid date format: YYYY-MM-DD\n", 32);
+            }
+        }
+    }
+    else if (strcmp(args[0], "dirlist") == 0 && num_args >= 2 && strcmp(args[1], "-a") == 0) {
+        printf("List Directories By File Name Invoked\n");
+        list_subdirectories(reply);
+    }
+    else if (strcmp(args[0], "dirlist") == 0 && num_args >= 2 && strcmp(args[1], "-t") == 0) {
+        printf("List Directories By File Date Invoked\n");
+        list_subdirectories_by_time(reply);
+    }
+    else if (strcmp(args[0], "quitc") == 0)
+    {
+        printf("Client requested to exit\n");
+        return -1;
+    }
+    else if (strcmp(args[0], "w24ping") == 0)
+    {
+        // Health check from the main server, report how many commands are waiting or running here
+        snprintf(message, sizeof(message), "w24pong %ld\n", job_queue_depth());
+        if (reply_send(reply, message, strlen(message)) < 0)
+        {
+            perror("send failed");
+            return -1;
+        }
+    }
+    else if (strcmp(args[0], "w24hello") == 0)
+    {
+        // Sent by the client right after connecting, a server that keeps the client answers w24ok
+        if (reply_send(reply, "w24ok\n", 6) < 0)
+        {
+            perror("send failed");
+            return -1;
+        }
+    }
+    else if (strcmp(args[0], "w24sync") == 0 && num_args >= 2)
+    {
+        // Only run once every earlier command of the connection is done (see process_messages()), so echoing
+        // the token marks the end of every earlier reply. The main server uses this to reuse a pooled
+        // connection once its client has left.
+        snprintf(message, sizeof(message), "w24sync %s\n", args[1]);
+        if (reply_send(reply, message, strlen(message)) < 0)
+        {
+            perror("send failed");
+            return -1;
+        }
+    }
+    else
+    {
+        // Text clients get no answer to an unknown command, a framed request always gets its reply frame
+        reply->status = STATUS_BAD_REQUEST;
+    }
+
+    return 0;
+}
+
+// Connection state for each client tracked by the event loop
+typedef struct client_conn {
+    int kind; // WATCH_CLIENT, epoll data is a client_conn_t, a relay_side_t, a mirror_link_t or a mux_link_t
+    int fd; // Client socket, always non-blocking
+    char message[CLIENT_MESSAGE_SIZE]; // Bytes received that don't form a full command yet
+    size_t length; // Number of bytes stored in message
+    int closing; // Set once the client quit or the connection failed
+    int redirect_to; // Mirror the client is told to reconnect to in redirect mode, 0 to serve it here
+    int pending; // Jobs of this connection queued or running on the worker pool, only touched by the event loop
+    bool stalled; // Reading stopped because MAX_PIPELINED commands are pending, or the next one waits for them
+    pthread_mutex_t write_lock; // Serializes the reply frames written by concurrent framed requests
+    bool archive_running; // An archive job of this connection is on the worker pool, it holds write_lock while it sends
+    struct job *held_head, *held_tail; // Jobs kept back until that archive is through, in the order they came
+} client_conn_t;
+
+enum { WATCH_CLIENT, WATCH_RELAY, WATCH_LINK, WATCH_MUX };
+
+// A command waiting for a worker thread
+typedef struct job {
+    client_conn_t *conn; // Connection the command came from, not watched by epoll until the job is done
+    char command[CLIENT_MESSAGE_SIZE + 1]; // The command line itself
+    bool framed; // The command came in a request frame
+    bool archive; // The command sends an archive
+    uint32_t request_id; // Id of that frame
+    int result; // What crequest() returned, -1 closes the connection
+    struct job *next; // Next job in the queue, then in the list of finished jobs
+} job_t;
+
+int epoll_fd; // Event loop instance
+int wake_fd; // eventfd the workers use to hand connections back to the event loop
+client_conn_t listener_tag, wake_tag; // Markers stored in epoll data for the non-client descriptors
+
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the job queue
+pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER; // Signalled when a job is queued
+job_t *job_head = NULL, *job_tail = NULL; // FIFO of jobs waiting for a worker
+long jobs_waiting = 0; // Jobs in the queue, protected by job_lock
+long jobs_running = 0; // Jobs a worker is busy with, updated atomically
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER; // Protects done_list
+job_t *done_list = NULL; // Jobs the workers have finished, the event loop takes their connections back
+
+// Load-aware routing: statistics kept for this server and each mirror, shared by all acceptor processes
+typedef struct {
+    long in_flight; // Commands currently running on the server
+    long connections; // Clients currently routed to the server
+    long latency_us; // Moving average of how long a command takes, in microseconds
+    int health; // HEALTH_UP, HEALTH_DEGRADED or HEALTH_DOWN, kept up to date by the health checker
+    long queue_depth; // Commands queued or running as reported by the mirror's last health check
+} server_load_t;
+
+enum { HEALTH_UP, HEALTH_DEGRADED, HEALTH_DOWN };
+
+enum { ROUTE_LEAST_LOADED, ROUTE_TWO_CHOICES };
+
+enum { ROLE_FRONT, ROLE_BACKEND };
+
+// A server of the cluster, entry 0 is this server itself and the others are its mirrors
+typedef struct {
+    char name[32]; // Name used in the logs
+    char ip[INET_ADDRSTRLEN]; // Address the server listens on
+    int port; // Port the server listens on
+} server_info_t;
+
+server_info_t servers[MAX_SERVERS] = {{"Server", SERVER_IP, SERVER_PORT}};
+int num_servers = 1; // This server plus the mirrors read from the config file
+int server_role = ROLE_FRONT; // A backend serves every client itself and has no mirrors
+server_load_t *server_load; // Lives in shared memory mapped before the acceptors are forked
+int routing_policy = ROUTE_TWO_CHOICES; // Selected with -r least|p2c
+bool redirect_mode = false; // Selected with -R, clients are sent to their mirror instead of being relayed
+
+// Maps the shared statistics, must run before the acceptor processes are forked
+void init_routing(void) {
+    server_load = mmap(NULL, MAX_SERVERS * sizeof(server_load_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (server_load == MAP_FAILED)
+    {
+        perror("Error: Failed to map routing statistics");
+        exit(1);
+    }
+    for (int i = 0; i < num_servers; i++)
+    {
+        server_load[i].latency_us = INITIAL_LATENCY_US;
+    }
+}
+
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Expected wait for a new command on a server: the queue in front of it times its average latency.
+// The queue is what this server has sent there or what the mirror reported, whichever is longer.
+long route_cost(int server) {
+    long in_flight = __atomic_load_n(&server_load[server].in_flight, __ATOMIC_RELAXED);
+    long reported = __atomic_load_n(&server_load[server].queue_depth, __ATOMIC_RELAXED);
+    long latency = __atomic_load_n(&server_load[server].latency_us, __ATOMIC_RELAXED);
+    long cost = ((in_flight > reported ? in_flight : reported) + 1) * latency;
+    if (__atomic_load_n(&server_load[server].health, __ATOMIC_RELAXED) == HEALTH_DEGRADED)
+    {
+        cost *= DEGRADED_PENALTY;
+    }
+    return cost;
+}
+
+bool server_is_down(int server) {
+    return __atomic_load_n(&server_load[server].health, __ATOMIC_RELAXED) == HEALTH_DOWN;
+}
+
+// Takes a mirror out of the rotation right away, the health checker puts it back once it answers again
+void mark_server_down(int server) {
+    if (__atomic_exchange_n(&server_load[server].health, HEALTH_DOWN, __ATOMIC_RELAXED) != HEALTH_DOWN)
+    {
+        fprintf(stderr, "%s is down, its clients go to the other servers\n", servers[server].name);
+    }
+}
+
+// True when server a should be preferred over server b, ties go to the one with fewer clients
+bool route_better(int a, int b) {
+    long cost_a = route_cost(a), cost_b = route_cost(b);
+    if (cost_a != cost_b)
+    {
+        return cost_a < cost_b;
+    }
+    return __atomic_load_n(&server_load[a].connections, __ATOMIC_RELAXED) <
+           __atomic_load_n(&server_load[b].connections, __ATOMIC_RELAXED);
+}
+
+// Picks the server for a new client
+int choose_server(void) {
+    // Only servers that are up take part, this server itself always does
+    int candidates[MAX_SERVERS] = {0};
+    int count = 1;
+    for (int i = 1; i < num_servers; i++)
+    {
+        if (!server_is_down(i))
+        {
+            candidates[count++] = i;
+        }
+    }
+
+    if (routing_policy == ROUTE_LEAST_LOADED || count < 2)
+    {
+        int best = candidates[0];
+        for (int i = 1; i < count; i++)
+        {
+            if (route_better(candidates[i], best))
+            {
+                best = candidates[i];
+            }
+        }
+        return best;
+    }
+
+    static bool seeded = false;
+    if (!seeded)
+    {
+        srandom(getpid()); // Every acceptor process draws its own random choices
+        seeded = true;
+    }
+
+    // Power of two choices: compare two random servers, this avoids every acceptor piling onto the same
+    // "least loaded" server before its statistics catch up
+    int first = random() % count;
+    int second = (first + 1 + random() % (count - 1)) % count;
+    return route_better(candidates[second], candidates[first]) ? candidates[second] : candidates[first];
+}
+
+// Sends w24ping to a mirror, returns the queue depth it reports or -1 if it did not answer in time
+long probe_mirror(int server, long *elapsed_us) {
+    long start_us = now_us();
+    long depth = -1;
+    struct sockaddr_in mirror_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr(servers[server].ip),
+        .sin_port = htons(servers[server].port),
+    };
+
+    int mirror_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mirror_socket == -1)
+    {
+        return -1;
+    }
+
+    struct pollfd pfd = {.fd = mirror_socket, .events = POLLOUT};
+    if (connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(mirror_addr)) == -1)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (errno != EINPROGRESS || poll(&pfd, 1, HEALTH_TIMEOUT_MS) != 1 ||
+            getsockopt(mirror_socket, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+        {
+            close(mirror_socket);
+            return -1;
+        }
+    }
+
+    if (send(mirror_socket, "w24ping\n", 8, 0) == 8)
+    {
+        char reply[64];
+        size_t received = 0;
+        pfd.events = POLLIN;
+        // Read the one line answer, giving up once the timeout has passed
+        while (received < sizeof(reply) - 1 && memchr(reply, '\n', received) == NULL)
+        {
+            long left_ms = HEALTH_TIMEOUT_MS - (now_us() - start_us) / 1000;
+            if (left_ms <= 0 || poll(&pfd, 1, left_ms) != 1)
+            {
+                break;
+            }
+            ssize_t n = recv(mirror_socket, reply + received, sizeof(reply) - 1 - received, 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            received += n;
+        }
+        reply[received] = '\0';
+        if (memchr(reply, '\n', received) == NULL || sscanf(reply, "w24pong %ld", &depth) != 1)
+        {
+            depth = -1;
+        }
+    }
+    close(mirror_socket);
+    *elapsed_us = now_us() - start_us;
+    return depth;
+}
+
+// Health checker process: pings every mirror and publishes whether it is up, degraded or down
+void run_health_checks(void) {
+    int failures[MAX_SERVERS] = {0};
+    const char *states[] = {"up", "degraded", "down"};
+
+    while (1)
+    {
+        for (int server = 1; server < num_servers; server++)
+        {
+            long elapsed_us = 0;
+            long depth = probe_mirror(server, &elapsed_us);
+            int health;
+            if (depth < 0)
+            {
+                failures[server]++;
+                health = failures[server] >= HEALTH_FAILURES_DOWN ? HEALTH_DOWN : __atomic_load_n(&server_load[server].health, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                failures[server] = 0;
+                __atomic_store_n(&server_load[server].queue_depth, depth, __ATOMIC_RELAXED);
+                health = (depth >= DEGRADED_QUEUE_DEPTH || elapsed_us > DEGRADED_PROBE_US) ? HEALTH_DEGRADED : HEALTH_UP;
+            }
+
+            int previous = __atomic_exchange_n(&server_load[server].health, health, __ATOMIC_RELAXED);
+            if (previous != health)
+            {
+                printf("Health check: %s is %s\n", servers[server].name, states[health]);
+            }
+        }
+        usleep(HEALTH_INTERVAL_MS * 1000);
+    }
+}
+
+// Forks the health checker, it shares the routing statistics with the acceptors
+void start_health_checker(void) {
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("Error: Could not fork health checker");
+    }
+    else if (pid == 0)
+    {
+        run_health_checks();
+        exit(EXIT_SUCCESS);
+    }
+}
+
+// In redirect mode answers the client's w24hello with the address of its mirror, the client then connects
+// there directly and this server stays out of the data path. Returns true if the client was redirected.
+bool send_redirect(client_conn_t *conn, const char *command) {
+    int server = conn->redirect_to;
+    if (server == 0)
+    {
+        return false;
+    }
+    conn->redirect_to = 0;
+
+    // Older clients don't send w24hello and can't follow a redirect, they are served here instead
+    if (strncmp(command, "w24hello", 8) != 0 || (command[8] != '\n' && command[8] != ' ' && command[8] != '\0'))
+    {
+        return false;
+    }
+
+    char message[100];
+    int length = snprintf(message, sizeof(message), "w24redirect %s %d\n", servers[server].ip, servers[server].port);
+    if (send_all(conn->fd, message, length, 0) < 0)
+    {
+        perror("Error: Failed to send redirect");
+    }
+    printf("Client redirected to %s\n", servers[server].name);
+    conn->closing = 1;
+    return true;
+}
+
+// Records the start of a command, returns the start time for route_command_done()
+long route_command_start(int server) {
+    __atomic_add_fetch(&server_load[server].in_flight, 1, __ATOMIC_RELAXED);
+    return now_us();
+}
+
+// Records the end of a command and folds its latency into the moving average
+void route_command_done(int server, long start_us) {
+    long sample = now_us() - start_us;
+    long average = __atomic_load_n(&server_load[server].latency_us, __ATOMIC_RELAXED);
+    average += (sample - average) >> LATENCY_EWMA_SHIFT;
+    __atomic_store_n(&server_load[server].latency_us, average > 0 ? average : 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&server_load[server].in_flight, 1, __ATOMIC_RELAXED);
+}
+
+// Commands with a reply of a few bytes, the event loop answers these itself. Everything else, dirlist included,
+// is run by the worker pool so the loop never waits for a client to take a long reply.
+bool is_instant_command(const char *command) {
+    const char *instant[] = {"w24ping", "w24hello", "w24sync", "quitc"};
+    size_t length = strcspn(command, " \n");
+    for (size_t i = 0; i < sizeof(instant) / sizeof(instant[0]); i++) {
+        if (strlen(instant[i]) == length && strncmp(command, instant[i], length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Commands whose reply is an archive, sent as one long write under the connection's write lock
+bool is_archive_command(const char *command) {
+    const char *archive[] = {"w24fz", "w24ft", "w24fdb", "w24fda"};
+    size_t length = strcspn(command, " \n");
+    for (size_t i = 0; i < sizeof(archive) / sizeof(archive[0]); i++) {
+        if (strlen(archive[i]) == length && strncmp(command, archive[i], length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs one command for a connection, returns -1 when the connection should be closed.
+// The socket stays non-blocking: replies go out with send_all(), which gives up on a client that stops reading.
+int run_command(client_conn_t *conn, const char *command, bool framed, uint32_t request_id) {
+    int result;
+    if (send_redirect(conn, command)) {
+        return 0;
+    }
+    long start_us = route_command_start(0);
+    reply_t reply = {.fd = conn->fd, .framed = framed, .write_lock = &conn->write_lock, .request_id = request_id};
+    result = crequest(&reply, command);
+    if (result == 0) {
+        reply_finish(&reply);
+    } else {
+        free(reply.text);
+    }
+    route_command_done(0, start_us);
+    return result;
+}
+
+// Worker thread: takes jobs off the queue and hands the connection back to the event loop when done
+void *worker_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&job_lock);
+        while (job_head == NULL) {
+            pthread_cond_wait(&job_ready, &job_lock);
+        }
+        job_t *job = job_head;
+        job_head = job->next;
+        if (job_head == NULL) {
+            job_tail = NULL;
+        }
+        jobs_waiting--;
+        __atomic_add_fetch(&jobs_running, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&job_lock);
+
+        job->result = run_command(job->conn, job->command, job->framed, job->request_id);
+        __atomic_sub_fetch(&jobs_running, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&done_lock);
+        job->next = done_list;
+        done_list = job;
+        pthread_mutex_unlock(&done_lock);
+
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("Error: Failed to wake the event loop");
+        }
+    }
+    return NULL;
+}
+
+// Queues a command for the worker pool
+// Puts a job at the end of the worker pool's queue
+void queue_job(job_t *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&job_lock);
+    if (job_tail) {
+        job_tail->next = job;
+    } else {
+        job_head = job;
+    }
+    job_tail = job;
+    jobs_waiting++;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&job_lock);
+}
+
+// Hands a command to the worker pool. An archive holds the connection's write lock until it is all sent, so
+// while one runs the later jobs of the connection are kept back here instead of taking workers that would only
+// wait for the lock, possibly for as long as the client takes to read the archive.
+void submit_job(client_conn_t *conn, const char *command, bool framed, uint32_t request_id) {
+    job_t *job = malloc(sizeof(job_t));
+    job->conn = conn;
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    job->framed = framed;
+    job->archive = is_archive_command(command);
+    job->request_id = request_id;
+    job->result = 0;
+    job->next = NULL;
+    conn->pending++;
+
+    if (conn->archive_running) {
+        if (conn->held_tail) {
+            conn->held_tail->next = job;
+        } else {
+            conn->held_head = job;
+        }
+        conn->held_tail = job;
+        return;
+    }
+    conn->archive_running = job->archive;
+    queue_job(job);
+}
+
+// Passes the jobs kept back by submit_job() to the pool once the archive they waited for is through,
+// up to the next archive
+void release_held_jobs(client_conn_t *conn) {
+    while (conn->held_head && !conn->archive_running) {
+        job_t *job = conn->held_head;
+        conn->held_head = job->next;
+        if (conn->held_head == NULL) {
+            conn->held_tail = NULL;
+        }
+        conn->archive_running = job->archive;
+        queue_job(job);
+    }
+}
+
+// Number of commands waiting for or running on the worker pool, reported to health checks
+long job_queue_depth(void) {
+    pthread_mutex_lock(&job_lock);
+    long depth = jobs_waiting;
+    pthread_mutex_unlock(&job_lock);
+    return depth + __atomic_load_n(&jobs_running, __ATOMIC_RELAXED);
+}
+
+// Starts the threads of the worker pool
+void start_worker_pool(void) {
+    for (int i = 0; i < WORKER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, NULL) != 0) {
+            perror("Error: Failed to start worker thread");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+void close_connection(client_conn_t *conn) {
+    __atomic_sub_fetch(&server_load[0].connections, 1, __ATOMIC_RELAXED);
+    close(conn->fd); // Closing the socket also removes it from epoll
+    pthread_mutex_destroy(&conn->write_lock);
+    free(conn);
+}
+
+// Takes the next complete command out of the connection buffer, either a request frame or a text line.
+// Returns false if it hasn't fully arrived yet, a malformed frame closes the connection.
+bool next_command(client_conn_t *conn, char *command, bool *framed, uint32_t *request_id) {
+    size_t consumed;
+    if (conn->length > 0 && (uint8_t)conn->message[0] == FRAME_MAGIC) {
+        if (conn->length < FRAME_HEADER_SIZE) {
+            return false; // Wait for the rest of the header
+        }
+        frame_header_t header;
+        memcpy(&header, conn->message, sizeof(header));
+        uint64_t length = be64toh(header.length);
+        if (header.type != FRAME_REQUEST || length > MAX_FRAME_COMMAND) {
+            fprintf(stderr, "Error: Malformed frame from client\n");
+            conn->closing = 1;
+            return false;
+        }
+        if (conn->length < FRAME_HEADER_SIZE + length) {
+            return false; // Wait for the rest of the payload
+        }
+        // The payload is the command without its newline, handlers expect the line as a text client sends it
+        memcpy(command, conn->message + FRAME_HEADER_SIZE, length);
+        command[length] = '\n';
+        command[length + 1] = '\0';
+        *framed = true;
+        *request_id = ntohl(header.request_id);
+        consumed = FRAME_HEADER_SIZE + length;
+    } else {
+        char *newline = memchr(conn->message, '\n', conn->length);
+        if (newline) {
+            consumed = newline - conn->message + 1;
+        } else if (conn->length == sizeof(conn->message)) {
+            consumed = conn->length; // No newline in a full buffer, treat it as one command
+        } else {
+            return false; // Wait for the rest of the command
+        }
+        memcpy(command, conn->message, consumed);
+        command[consumed] = '\0';
+        *framed = false;
+        *request_id = 0;
+    }
+    memmove(conn->message, conn->message + consumed, conn->length - consumed);
+    conn->length -= consumed;
+    return true;
+}
+
+// Tells whether the next buffered command has to wait until every earlier one is done: a text command, whose
+// reply has no frame around it to keep it apart from the others, or a w24sync, which vouches for all of them
+bool next_is_barrier(const client_conn_t *conn) {
+    if (conn->length == 0) {
+        return false;
+    }
+    if ((uint8_t)conn->message[0] != FRAME_MAGIC) {
+        return true;
+    }
+    return conn->length >= FRAME_HEADER_SIZE + 7 && memcmp(conn->message + FRAME_HEADER_SIZE, "w24sync", 7) == 0;
+}
+
+// Runs the buffered commands of a connection. A text command that has to go to the worker pool holds the
+// connection until it is done, framed requests are handed to the pool and reading goes on, so a client can
+// pipeline many requests and gets each reply as soon as it is ready.
+void process_messages(client_conn_t *conn) {
+    char command[CLIENT_MESSAGE_SIZE + 1];
+    bool framed;
+    uint32_t request_id;
+    conn->stalled = false;
+    while (!conn->closing) {
+        if (conn->pending >= MAX_PIPELINED || (conn->pending > 0 && next_is_barrier(conn))) {
+            conn->stalled = true; // Resumed by the event loop when one of the jobs finishes
+            return;
+        }
+        if (!next_command(conn, command, &framed, &request_id)) {
+            break;
+        }
+        // Only short replies are sent from the event loop, and a framed one only when no worker may be streaming
+        // an archive to the same client under the write lock
+        if (!is_instant_command(command) || (framed && conn->pending > 0)) {
+            submit_job(conn, command, framed, request_id);
+            if (!framed) {
+                return;
+            }
+            continue;
+        }
+        if (run_command(conn, command, framed, request_id) < 0) {
+            conn->closing = 1;
+        }
+    }
+
+    if (conn->closing) {
+        // Jobs still running write to the socket, the last one to finish closes it
+        if (conn->pending == 0) {
+            close_connection(conn);
+        }
+        return;
+    }
+
+    // Wait for the next command from this client
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("Error: Failed to re-arm client socket");
+        close_connection(conn);
+    }
+}
+
+// Called by the event loop for every job the workers have finished
+void finish_job(job_t *job) {
+    client_conn_t *conn = job->conn;
+    conn->pending--;
+    if (job->archive) {
+        conn->archive_running = false;
+        release_held_jobs(conn);
+    }
+    if (job->result < 0) {
+        conn->closing = 1;
+    }
+    if (conn->closing) {
+        if (conn->pending == 0) {
+            close_connection(conn);
+        }
+    } else if (!job->framed || conn->stalled) {
+        process_messages(conn); // The connection was waiting for this job, carry on with its commands
+    }
+    free(job);
+}
+
+// Reads everything the client has sent so far and runs the complete commands
+void read_client(client_conn_t *conn) {
+    while (conn->length < sizeof(conn->message)) {
+        ssize_t read_size = recv(conn->fd, conn->message + conn->length, sizeof(conn->message) - conn->length, 0);
+        if (read_size > 0) {
+            conn->length += read_size;
+            continue;
+        }
+        if (read_size == 0) {
+            printf("Client disconnected\n");
+            conn->closing = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Error: Failed to receive from client");
+            conn->closing = 1;
+        }
+        break;
+    }
+    process_messages(conn);
+}
+
+// Starts watching a newly accepted client
+client_conn_t *add_connection(int client_socket) {
+    client_conn_t *conn = calloc(1, sizeof(client_conn_t));
+    conn->kind = WATCH_CLIENT;
+    conn->fd = client_socket;
+    pthread_mutex_init(&conn->write_lock, NULL);
+    __atomic_add_fetch(&server_load[0].connections, 1, __ATOMIC_RELAXED);
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
+        perror("Error: Failed to watch client socket");
+        close_connection(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+// Pool of warm connections to the mirrors, owned by the event loop of each acceptor process.
+// A client routed to a mirror that needs a connection of its own takes an idle one instead of paying for
+// connect(), and when the client leaves the connection is synced and put back for the next one.
+enum { LINK_CONNECTING, LINK_IDLE, LINK_DRAINING };
+
+typedef struct mirror_link {
+    int kind; // WATCH_LINK
+    int fd; // Socket connected (or connecting) to the mirror
+    int server; // Mirror this connection goes to
+    int state; // LINK_CONNECTING, LINK_IDLE or LINK_DRAINING
+    char sync_reply[64]; // Line that ends the output of the previous client while draining
+    char tail[64]; // Last bytes received while draining, compared against sync_reply
+    size_t tail_length; // Number of bytes in tail
+    long drain_deadline_us; // When a draining connection is given up
+    struct mirror_link *next; // Next idle connection to the same mirror, or next draining one
+} mirror_link_t;
+
+mirror_link_t *idle_links[MAX_SERVERS]; // Ready connections to each mirror
+int warming_links[MAX_SERVERS]; // Connections to each mirror that are idle or still connecting
+mirror_link_t *draining_links; // Connections waiting for their sync echo, oldest deadline last
+
+// Takes a connection off the draining list
+void stop_draining(mirror_link_t *link) {
+    mirror_link_t **slot = &draining_links;
+    while (*slot != link)
+    {
+        slot = &(*slot)->next;
+    }
+    *slot = link->next;
+}
+
+void close_link(mirror_link_t *link) {
+    if (link->state == LINK_DRAINING)
+    {
+        stop_draining(link);
+    }
+    else
+    {
+        warming_links[link->server]--;
+    }
+    close(link->fd); // Closing the socket also removes it from epoll
+    free(link);
+}
+
+bool watch_link(mirror_link_t *link, int operation, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = link};
+    if (epoll_ctl(epoll_fd, operation, link->fd, &ev) == -1)
+    {
+        perror("Error: Failed to watch mirror connection");
+        return false;
+    }
+    return true;
+}
+
+// Opens connections until the pool of a mirror is full again
+void fill_mirror_pool(int server) {
+    while (warming_links[server] < MIRROR_POOL_SIZE)
+    {
+        struct sockaddr_in mirror_addr = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = inet_addr(servers[server].ip),
+            .sin_port = htons(servers[server].port),
+        };
+        int mirror_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mirror_socket == -1)
+        {
+            perror("Error: Failed to create mirror socket");
+            return;
+        }
+        if (connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(mirror_addr)) == -1 && errno != EINPROGRESS)
+        {
+            close(mirror_socket); // Mirror is down, try again when the next client needs it
+            return;
+        }
+
+        mirror_link_t *link = calloc(1, sizeof(mirror_link_t));
+        link->kind = WATCH_LINK;
+        link->fd = mirror_socket;
+        link->server = server;
+        link->state = LINK_CONNECTING;
+        warming_links[server]++;
+        if (!watch_link(link, EPOLL_CTL_ADD, EPOLLOUT))
+        {
+            close_link(link);
+            return;
+        }
+    }
+}
+
+struct mux_link *choose_mux_link(int server);
+
+// Warms up the pools of every mirror when an acceptor starts, along with the connections shared by framed clients
+void start_mirror_pools(void) {
+    for (int server = 1; server < num_servers; server++)
+    {
+        fill_mirror_pool(server);
+        choose_mux_link(server);
+    }
+}
+
+// Takes an idle connection to a mirror out of the pool, returns -1 if there is none
+int take_mirror_link(int server) {
+    mirror_link_t *link = idle_links[server];
+    if (link == NULL)
+    {
+        return -1;
+    }
+    idle_links[server] = link->next;
+    warming_links[server]--;
+    int mirror_socket = link->fd;
+    free(link); // The connection comes back through recycle_mirror_socket() once the client leaves
+    return mirror_socket;
+}
+
+void make_link_idle(mirror_link_t *link) {
+    if (link->state == LINK_DRAINING)
+    {
+        if (warming_links[link->server] >= MIRROR_POOL_SIZE)
+        {
+            close_link(link); // Pool is already full
+            return;
+        }
+        stop_draining(link);
+        warming_links[link->server]++;
+    }
+    link->state = LINK_IDLE;
+    if (!watch_link(link, EPOLL_CTL_MOD, EPOLLIN)) // Readable while idle means the mirror closed it
+    {
+        close_link(link);
+        return;
+    }
+    link->next = idle_links[link->server];
+    idle_links[link->server] = link;
+}
+
+// Starts reusing the mirror socket of a client that has gone away. The mirror still has to finish whatever
+// the client asked for, so a w24sync is queued behind it and the output is discarded until the echo arrives.
+// The caller makes sure the client's last command was complete, or the sync would be read as part of it.
+void recycle_mirror_socket(int mirror_socket, int server) {
+    mirror_link_t *link = calloc(1, sizeof(mirror_link_t));
+    link->kind = WATCH_LINK;
+    link->fd = mirror_socket;
+    link->server = server;
+    link->state = LINK_DRAINING;
+    link->drain_deadline_us = now_us() + DRAIN_TIMEOUT_MS * 1000L;
+    link->next = draining_links; // Every link waits equally long, so the list stays sorted by deadline
+    draining_links = link;
+    snprintf(link->sync_reply, sizeof(link->sync_reply), "w24sync %lx%lx\n", random(), random());
+
+    size_t length = strlen(link->sync_reply);
+    if (send(mirror_socket, link->sync_reply, length, 0) != (ssize_t)length || !watch_link(link, EPOLL_CTL_MOD, EPOLLIN))
+    {
+        close_link(link);
+        return;
+    }
+}
+
+// Closes the draining connections whose mirror is still busy with the previous client's commands, say a large
+// archive nobody is going to read. Returns how long epoll_wait() may sleep until the next deadline, -1 if none.
+int expire_draining_links(void) {
+    long now = now_us();
+    mirror_link_t **slot = &draining_links;
+    while (*slot != NULL && (*slot)->drain_deadline_us > now)
+    {
+        slot = &(*slot)->next;
+    }
+    while (*slot != NULL)
+    {
+        close_link(*slot); // Takes it off the list, *slot moves on to the next one
+    }
+    if (draining_links == NULL)
+    {
+        return -1;
+    }
+    mirror_link_t *oldest = draining_links;
+    while (oldest->next != NULL)
+    {
+        oldest = oldest->next;
+    }
+    return (oldest->drain_deadline_us - now) / 1000 + 1;
+}
+
+// Discards the rest of a previous client's output, the connection is clean once it ends with the sync echo
+void drain_link(mirror_link_t *link) {
+    char buffer[BUFFER_SIZE];
+    size_t expected = strlen(link->sync_reply);
+
+    while (1)
+    {
+        ssize_t received = recv(link->fd, buffer, sizeof(buffer), 0);
+        if (received > 0)
+        {
+            // Keep only the last bytes, the echo is always the very end of the stream
+            if ((size_t)received >= expected)
+            {
+                memcpy(link->tail, buffer + received - expected, expected);
+                link->tail_length = expected;
+            }
+            else
+            {
+                size_t keep = link->tail_length + received > expected ? expected - received : link->tail_length;
+                memmove(link->tail, link->tail + link->tail_length - keep, keep);
+                memcpy(link->tail + keep, buffer, received);
+                link->tail_length = keep + received;
+            }
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            break;
+        }
+        close_link(link); // Mirror closed the connection or failed
+        return;
+    }
+
+    if (link->tail_length == expected && memcmp(link->tail, link->sync_reply, expected) == 0)
+    {
+        make_link_idle(link);
+    }
+}
+
+// Handles readiness on a pooled mirror connection
+void link_event(mirror_link_t *link) {
+    if (link->state == LINK_CONNECTING)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            close_link(link); // Mirror is down, the pool is refilled when the next client needs it
+            return;
+        }
+        make_link_idle(link);
+    }
+    else if (link->state == LINK_DRAINING)
+    {
+        drain_link(link);
+    }
+    else
+    {
+        // Idle connections never receive anything, the mirror has closed this one
+        mirror_link_t **slot = &idle_links[link->server];
+        while (*slot != link)
+        {
+            slot = &(*slot)->next;
+        }
+        *slot = link->next;
+        close_link(link);
+    }
+}
+
+// Relay between a client and a mirror. The short framed requests of a client share a few connections to the
+// mirror with those of the other clients of this acceptor: each request gets an id unique on the shared
+// connection, and its reply frames are copied into the client's backlog with the client's own id. A shared
+// connection is always read at once, so a client that is slow to take its replies holds up nobody else.
+// Archives are long and text replies have no frame to tell them apart, so the first archive request or text
+// command gives the client a pooled mirror connection of its own, and from then on bytes move
+// socket -> pipe -> socket with splice(), so archives never get copied through user space.
+typedef struct relay relay_t;
+
+// One of the two sockets of a relay, this is what epoll hands back
+typedef struct {
+    int kind; // WATCH_RELAY
+    relay_t *relay; // Relay the socket belongs to
+} relay_side_t;
+
+enum { RELAY_WAITING, RELAY_SHARED, RELAY_SPLICE };
+
+// A request sent over a shared mirror connection, kept until the last frame of its reply has gone through
+typedef struct mux_request {
+    uint32_t id; // Id of the request on the shared connection
+    uint32_t client_id; // Id the client gave the request, put back into every frame of the reply
+    relay_t *relay; // Client the reply goes to, NULL once it has left and the rest of the reply is discarded
+    long start_us; // When the request was sent, 0 once its reply has started arriving
+    struct mux_request *next; // Next request waiting on the same connection
+} mux_request_t;
+
+// A connection to a mirror that carries the request frames of many clients at once
+typedef struct mux_link {
+    int kind; // WATCH_MUX
+    int fd; // Socket connected (or connecting) to the mirror
+    int server; // Mirror this connection goes to
+    int slot; // Index of the connection in mux_links[server]
+    bool connecting; // Still waiting for the non-blocking connect
+    char *out; // Request frames not written to the socket yet
+    size_t out_length, out_sent, out_capacity; // Bytes in out, bytes of them already sent, size of out
+    uint32_t next_id; // Id given to the next request
+    int outstanding; // Requests whose reply hasn't fully arrived
+    mux_request_t *requests; // Those requests
+    frame_header_t header; // Header of the reply frame being read
+    size_t header_length; // Bytes of header received
+    mux_request_t *current; // Request the frame answers, once its header is complete
+    uint64_t payload_left; // Payload bytes of the frame still to pass on
+} mux_link_t;
+
+mux_link_t *mux_links[MAX_SERVERS][MUX_LINKS]; // Shared connections to each mirror, NULL where none is open
+
+struct relay {
+    relay_side_t sides[2]; // Index 0 is the client socket, index 1 the mirror socket
+    int fds[2]; // Client socket and mirror socket, the latter is -1 until the client gets a connection of its own
+    int pipes[2][2]; // pipes[0] carries client -> mirror, pipes[1] carries mirror -> client
+    size_t pending[2]; // Bytes sitting in each pipe
+    bool done[2]; // Set once a direction has seen end of file and passed it on
+    bool connecting; // Still waiting for the non-blocking connect to the mirror
+    bool client_left; // Client closed its side while the mirror connection is still usable
+    bool in_line; // The client is in the middle of a text command
+    frame_header_t request_header; // Header of the client's next request frame, while it arrives
+    size_t header_length; // Bytes of request_header received
+    uint64_t request_left; // Payload bytes of the client's current request frame still to come
+    int server; // Mirror the client was routed to
+    long request_start_us; // When the client last sent a command the mirror has not answered yet, 0 if none
+    int mode; // RELAY_WAITING until the first command, then RELAY_SHARED for request frames or RELAY_SPLICE
+    char received[CLIENT_MESSAGE_SIZE]; // Bytes from the client not passed on yet, outside RELAY_SPLICE
+    size_t received_length; // Number of bytes in received
+    mux_link_t *mux; // Shared connection the client's requests are waiting on, NULL when none is
+    int outstanding; // Requests of the client whose reply hasn't fully arrived
+    char *replies; // Reply frames from the shared connection the client hasn't taken yet
+    size_t replies_length, replies_sent, replies_capacity; // Bytes in replies, bytes of them sent, size of replies
+};
+
+void route_client(int client_socket, const char *received, size_t length);
+
+// Watches a shared connection for replies, and for room to write the requests still queued
+void mux_update_events(mux_link_t *link) {
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = link};
+    if (!link->connecting)
+    {
+        ev.events = EPOLLIN | (link->out_sent < link->out_length ? EPOLLOUT : 0);
+    }
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, link->fd, &ev) == -1)
+    {
+        perror("Error: Failed to update mirror connection events");
+    }
+}
+
+void close_relay(relay_t *relay) {
+    if (relay->request_start_us)
+    {
+        route_command_done(relay->server, relay->request_start_us);
+    }
+    if (relay->mux)
+    {
+        // The mirror still answers the client's requests, the replies are read and thrown away
+        for (mux_request_t *request = relay->mux->requests; request != NULL; request = request->next)
+        {
+            if (request->relay == relay)
+            {
+                request->relay = NULL;
+            }
+        }
+    }
+    __atomic_sub_fetch(&server_load[relay->server].connections, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < 2; i++)
+    {
+        if (relay->fds[i] >= 0)
+        {
+            close(relay->fds[i]); // Closing the sockets also removes them from epoll
+        }
+        close(relay->pipes[i][0]);
+        close(relay->pipes[i][1]);
+    }
+    free(relay->replies);
+    free(relay);
+}
+
+// The mirror could not be reached: take it out of the rotation and route the client again. The bytes the
+// client has sent so far are still in the pipe, they go along so the next server sees its commands from the start.
+void fail_over_relay(relay_t *relay) {
+    int client_socket = relay->fds[0];
+    char received[CLIENT_MESSAGE_SIZE];
+    ssize_t length = relay->pending[0] > 0 ? read(relay->pipes[0][0], received, sizeof(received)) : 0;
+    mark_server_down(relay->server);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_socket, NULL); // May not be registered yet
+    relay->fds[0] = -1;
+    close_relay(relay);
+    printf("Client rerouted, ");
+    route_client(client_socket, received, length > 0 ? length : 0);
+}
+
+// Follows the commands a client sends through the relay, so it is known whether it stopped between two of them
+void relay_track_commands(relay_t *relay, const char *data, size_t length) {
+    for (size_t i = 0; i < length;)
+    {
+        if (relay->request_left > 0)
+        {
+            size_t skip = length - i < relay->request_left ? length - i : relay->request_left;
+            relay->request_left -= skip;
+            i += skip;
+        }
+        else if (relay->header_length > 0 || (!relay->in_line && (uint8_t)data[i] == FRAME_MAGIC))
+        {
+            ((uint8_t *)&relay->request_header)[relay->header_length++] = data[i++];
+            if (relay->header_length == FRAME_HEADER_SIZE)
+            {
+                relay->request_left = be64toh(relay->request_header.length);
+                relay->header_length = 0;
+            }
+        }
+        else
+        {
+            const char *newline = memchr(data + i, '\n', length - i);
+            relay->in_line = newline == NULL;
+            i = newline ? (size_t)(newline - data) + 1 : length;
+        }
+    }
+}
+
+// Moves as much as possible in one direction, returns false when the relay has to be torn down.
+// Commands are short, so they are copied through a buffer where relay_track_commands() can see them.
+// Replies may be whole archives, they go through the pipe with splice() and are never copied.
+bool relay_pump(relay_t *relay, int direction) {
+    int source = relay->fds[direction];
+    int destination = relay->fds[1 - direction];
+    int *pipe_fds = relay->pipes[direction];
+
+    while (!relay->done[direction])
+    {
+        if (relay->pending[direction] > 0)
+        {
+            // Drain the pipe into the destination socket first
+            ssize_t moved = splice(pipe_fds[0], NULL, destination, NULL, relay->pending[direction], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0)
+            {
+                relay->pending[direction] -= moved;
+                if (direction == 1 && relay->request_start_us)
+                {
+                    // First bytes of the mirror's answer, count the command as done for the routing statistics
+                    route_command_done(relay->server, relay->request_start_us);
+                    relay->request_start_us = 0;
+                }
+                continue;
+            }
+            if (moved < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                return true; // Destination is full, wait for EPOLLOUT
+            }
+            return false;
+        }
+
+        ssize_t moved;
+        if (direction == 0)
+        {
+            // The pipe is empty, so it takes the whole buffer at once
+            char buffer[BUFFER_SIZE];
+            moved = recv(source, buffer, sizeof(buffer), 0);
+            if (moved > 0)
+            {
+                relay_track_commands(relay, buffer, moved);
+                if (write(pipe_fds[1], buffer, moved) != moved)
+                {
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            moved = splice(source, NULL, pipe_fds[1], NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        if (moved > 0)
+        {
+            relay->pending[direction] += moved;
+            if (direction == 0 && !relay->request_start_us)
+            {
+                relay->request_start_us = route_command_start(relay->server);
+            }
+            continue;
+        }
+        if (moved == 0 && direction == 0 && !relay->done[1] && !relay->in_line && relay->header_length == 0 && relay->request_left == 0)
+        {
+            // Client is gone after a whole command and the mirror connection is fine, it goes back to the pool.
+            // Otherwise the w24sync would be glued to the unfinished command, the connection is closed instead.
+            relay->done[0] = true;
+            relay->client_left = true;
+            return true;
+        }
+        if (moved == 0)
+        {
+            // End of file, pass it on so the other side sees the same half-close
+            shutdown(destination, SHUT_WR);
+            relay->done[direction] = true;
+            return true;
+        }
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return true; // Nothing more to read, wait for EPOLLIN
+        }
+        return false;
+    }
+    return true;
+}
+
+// Watches each socket for exactly what its directions are waiting on
+bool relay_update_events(relay_t *relay) {
+    for (int i = 0; i < 2; i++)
+    {
+        if (relay->fds[i] < 0)
+        {
+            continue; // No mirror connection of its own
+        }
+        struct epoll_event ev = {.events = 0, .data.ptr = &relay->sides[i]};
+        if (relay->connecting)
+        {
+            ev.events = (i == 1) ? EPOLLOUT : 0;
+        }
+        else
+        {
+            // Room in the outgoing pipe, read more from this socket. A client on a shared connection also waits
+            // while its buffer is full or MAX_PIPELINED of its requests are outstanding.
+            if (!relay->done[i] && relay->pending[i] == 0 &&
+                (i == 1 || (relay->received_length < sizeof(relay->received) && relay->outstanding < MAX_PIPELINED)))
+            {
+                ev.events |= EPOLLIN;
+            }
+            if (relay->pending[1 - i] > 0 || (i == 0 && relay->replies_sent < relay->replies_length))
+            {
+                ev.events |= EPOLLOUT; // Data waiting to be written to this socket
+            }
+        }
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, relay->fds[i], &ev) == -1)
+        {
+            perror("Error: Failed to update relay events");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends the client the replies that came over a shared connection, returns false if the client failed
+bool relay_flush_replies(relay_t *relay) {
+    while (relay->replies_sent < relay->replies_length)
+    {
+        ssize_t sent = send(relay->fds[0], relay->replies + relay->replies_sent, relay->replies_length - relay->replies_sent, 0);
+        if (sent > 0)
+        {
+            relay->replies_sent += sent;
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return true; // Client is full, wait for EPOLLOUT
+        }
+        return false;
+    }
+    relay->replies_length = relay->replies_sent = 0;
+    return true;
+}
+
+// Adds reply bytes to the client's backlog and sends what the client takes. A client that leaves more than
+// MUX_BACKLOG_MAX untaken is closed, the shared connection never waits for it. Returns false once it is closed.
+bool relay_queue_reply(relay_t *relay, const void *data, size_t length) {
+    if (relay->replies_length + length > relay->replies_capacity)
+    {
+        size_t backlog = relay->replies_length - relay->replies_sent;
+        if (backlog + length > MUX_BACKLOG_MAX)
+        {
+            printf("Client dropped, it stopped taking its replies\n");
+            close_relay(relay);
+            return false;
+        }
+        memmove(relay->replies, relay->replies + relay->replies_sent, backlog);
+        relay->replies_length = backlog;
+        relay->replies_sent = 0;
+        if (backlog + length > relay->replies_capacity)
+        {
+            relay->replies_capacity = (backlog + length) * 2;
+            relay->replies = realloc(relay->replies, relay->replies_capacity);
+        }
+    }
+    memcpy(relay->replies + relay->replies_length, data, length);
+    relay->replies_length += length;
+    if (!relay_flush_replies(relay) || !relay_update_events(relay))
+    {
+        close_relay(relay);
+        return false;
+    }
+    return true;
+}
+
+// Opens a shared connection to a mirror in a free slot, it takes requests once the connect has finished
+void open_mux_link(int server, int slot) {
+    struct sockaddr_in mirror_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr(servers[server].ip),
+        .sin_port = htons(servers[server].port),
+    };
+    int mirror_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mirror_socket == -1)
+    {
+        perror("Error: Failed to create mirror socket");
+        return;
+    }
+    if (connect(mirror_socket, (struct sockaddr *)&mirror_addr, sizeof(mirror_addr)) == -1 && errno != EINPROGRESS)
+    {
+        close(mirror_socket); // Mirror is down, try again when the next client needs it
+        return;
+    }
+
+    mux_link_t *link = calloc(1, sizeof(mux_link_t));
+    link->kind = WATCH_MUX;
+    link->fd = mirror_socket;
+    link->server = server;
+    link->slot = slot;
+    link->connecting = true;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = link};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mirror_socket, &ev) == -1)
+    {
+        perror("Error: Failed to watch mirror connection");
+        close(mirror_socket);
+        free(link);
+        return;
+    }
+    mux_links[server][slot] = link;
+}
+
+// Closes a shared connection. The mirror is gone or broke the protocol, so the clients still waiting on it
+// will never get their replies and are disconnected as well.
+void close_mux_link(mux_link_t *link) {
+    mux_links[link->server][link->slot] = NULL;
+    close(link->fd); // Closing the socket also removes it from epoll
+    while (link->requests != NULL)
+    {
+        mux_request_t *request = link->requests;
+        link->requests = request->next;
+        if (request->start_us)
+        {
+            route_command_done(link->server, request->start_us);
+        }
+        relay_t *relay = request->relay;
+        free(request);
+        if (relay != NULL)
+        {
+            for (mux_request_t *other = link->requests; other != NULL; other = other->next)
+            {
+                if (other->relay == relay)
+                {
+                    other->relay = NULL;
+                }
+            }
+            relay->mux = NULL;
+            close_relay(relay);
+        }
+    }
+    free(link->out);
+    free(link);
+}
+
+// Picks the connected shared connection to a mirror with the fewest outstanding requests, and opens the
+// missing ones. Returns NULL while none is connected.
+mux_link_t *choose_mux_link(int server) {
+    mux_link_t *best = NULL;
+    for (int slot = 0; slot < MUX_LINKS; slot++)
+    {
+        mux_link_t *link = mux_links[server][slot];
+        if (link == NULL)
+        {
+            open_mux_link(server, slot);
+        }
+        else if (!link->connecting && (best == NULL || link->outstanding < best->outstanding))
+        {
+            best = link;
+        }
+    }
+    return best;
+}
+
+// Writes the queued request frames, returns false if the connection failed
+bool mux_write(mux_link_t *link) {
+    while (link->out_sent < link->out_length)
+    {
+        ssize_t sent = send(link->fd, link->out + link->out_sent, link->out_length - link->out_sent, 0);
+        if (sent > 0)
+        {
+            link->out_sent += sent;
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return true; // Mirror is busy, wait for EPOLLOUT
+        }
+        return false;
+    }
+    link->out_length = link->out_sent = 0;
+    return true;
+}
+
+// Sends a request frame of a client over its shared connection under an id of the connection's own.
+// A write error is left for the event loop to find, so the connection is never closed under the caller's feet.
+void mux_send(relay_t *relay, const char *frame, size_t size) {
+    mux_link_t *link = relay->mux;
+    frame_header_t header;
+    memcpy(&header, frame, sizeof(header));
+
+    mux_request_t *request = calloc(1, sizeof(mux_request_t));
+    request->id = link->next_id++;
+    request->client_id = ntohl(header.request_id);
+    request->relay = relay;
+    request->start_us = route_command_start(link->server);
+    request->next = link->requests;
+    link->requests = request;
+    link->outstanding++;
+    relay->outstanding++;
+
+    if (link->out_length + size > link->out_capacity)
+    {
+        link->out_capacity = (link->out_length + size) * 2;
+        link->out = realloc(link->out, link->out_capacity);
+    }
+    header.request_id = htonl(request->id);
+    memcpy(link->out + link->out_length, &header, sizeof(header));
+    memcpy(link->out + link->out_length + sizeof(header), frame + sizeof(header), size - sizeof(header));
+    link->out_length += size;
+    mux_write(link);
+    mux_update_events(link);
+}
+
+// Checks the header of a reply frame from a shared connection and finds the request it answers
+bool mux_start_reply(mux_link_t *link) {
+    if (link->header.magic != FRAME_MAGIC || link->header.type < FRAME_TEXT || link->header.type > FRAME_ARCHIVE_PART)
+    {
+        fprintf(stderr, "Error: Malformed frame from mirror server\n");
+        return false;
+    }
+    uint32_t id = ntohl(link->header.request_id);
+    mux_request_t *request = link->requests;
+    while (request != NULL && request->id != id)
+    {
+        request = request->next;
+    }
+    if (request == NULL)
+    {
+        fprintf(stderr, "Error: Mirror server answered a request it was never sent\n");
+        return false;
+    }
+    if (request->start_us)
+    {
+        // First bytes of the mirror's answer, count the request as done for the routing statistics
+        route_command_done(link->server, request->start_us);
+        request->start_us = 0;
+    }
+    link->current = request;
+    link->payload_left = be64toh(link->header.length);
+    if (request->relay != NULL)
+    {
+        frame_header_t header = link->header;
+        header.request_id = htonl(request->client_id);
+        relay_queue_reply(request->relay, &header, sizeof(header)); // Orphans the request if the client is dropped
+    }
+    return true;
+}
+
+void relay_receive(relay_t *relay);
+
+// A reply frame has gone through. After the last frame of a reply its request is forgotten, and the client
+// may send more requests or move on to a connection of its own.
+void mux_end_reply(mux_link_t *link) {
+    mux_request_t *request = link->current;
+    relay_t *relay = request->relay;
+    link->header_length = 0;
+    link->current = NULL;
+    if (link->header.type == FRAME_ARCHIVE_PART && link->header.length != 0)
+    {
+        return;
+    }
+
+    mux_request_t **slot = &link->requests;
+    while (*slot != request)
+    {
+        slot = &(*slot)->next;
+    }
+    *slot = request->next;
+    free(request);
+    link->outstanding--;
+    if (relay != NULL)
+    {
+        if (--relay->outstanding == 0)
+        {
+            relay->mux = NULL; // Its next request may go over another connection
+        }
+        relay_receive(relay);
+    }
+}
+
+// Copies the reply frames arriving on a shared connection to the clients they belong to. The connection is
+// read as fast as the mirror sends, whatever pace the clients take their replies at. Returns false once it is closed.
+bool mux_read(mux_link_t *link) {
+    char buffer[RELAY_CHUNK];
+    while (1)
+    {
+        if (link->header_length == FRAME_HEADER_SIZE && link->payload_left == 0)
+        {
+            mux_end_reply(link);
+            continue;
+        }
+
+        ssize_t moved;
+        if (link->header_length < FRAME_HEADER_SIZE)
+        {
+            moved = recv(link->fd, (char *)&link->header + link->header_length, FRAME_HEADER_SIZE - link->header_length, 0);
+            if (moved > 0)
+            {
+                link->header_length += moved;
+                if (link->header_length == FRAME_HEADER_SIZE && !mux_start_reply(link))
+                {
+                    close_mux_link(link);
+                    return false;
+                }
+                continue;
+            }
+        }
+        else
+        {
+            moved = recv(link->fd, buffer, link->payload_left < sizeof(buffer) ? link->payload_left : sizeof(buffer), 0);
+            if (moved > 0)
+            {
+                link->payload_left -= moved;
+                if (link->current->relay != NULL)
+                {
+                    relay_queue_reply(link->current->relay, buffer, moved); // Nothing to do if the client has left
+                }
+                continue;
+            }
+        }
+
+        if (moved < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (moved == 0)
+        {
+            fprintf(stderr, "Error: Mirror server closed a shared connection\n");
+        }
+        close_mux_link(link); // Mirror closed the connection or failed
+        return false;
+    }
+}
+
+// Handles readiness on a shared mirror connection
+void mux_event(mux_link_t *link) {
+    if (link->connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            close_mux_link(link); // Mirror is down, the next client opens it again
+            return;
+        }
+        link->connecting = false;
+    }
+    if (!mux_write(link))
+    {
+        close_mux_link(link);
+        return;
+    }
+    if (mux_read(link))
+    {
+        mux_update_events(link);
+    }
+}
+
+// Gives the client a mirror connection of its own, for text commands whose replies no frame tells apart.
+// The client keeps it until it leaves. Returns false once the relay is gone.
+bool relay_start_splice(relay_t *relay) {
+    relay->mode = RELAY_SPLICE;
+    relay->done[0] = false; // An end of file already seen is read again from the socket and passed on
+    if (relay->received_length > 0)
+    {
+        if (write(relay->pipes[0][1], relay->received, relay->received_length) != (ssize_t)relay->received_length)
+        {
+            close_relay(relay);
+            return false;
+        }
+        relay->pending[0] = relay->received_length;
+        relay_track_commands(relay, relay->received, relay->received_length);
+        relay->request_start_us = route_command_start(relay->server);
+        relay->received_length = 0;
+    }
+
+    // A warm connection from the pool is already registered with epoll, only its events change
+    relay->fds[1] = take_mirror_link(relay->server);
+    bool pooled = relay->fds[1] >= 0;
+    if (!pooled)
+    {
+        // Setting up mirror server address
+        struct sockaddr_in mirror_addr = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = inet_addr(servers[relay->server].ip),
+            .sin_port = htons(servers[relay->server].port),
+        };
+
+        // Pool is empty, create a socket for the mirror server and connect without blocking the event loop
+        relay->fds[1] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (relay->fds[1] < 0)
+        {
+            perror("Error: Failed to set up relay to mirror server");
+            close_relay(relay);
+            return false;
+        }
+        if (connect(relay->fds[1], (struct sockaddr *)&mirror_addr, sizeof(mirror_addr)) == -1)
+        {
+            if (errno != EINPROGRESS)
+            {
+                perror("Error: Failed to setup connection to mirror server");
+                fail_over_relay(relay);
+                return false;
+            }
+            relay->connecting = true;
+        }
+        fill_mirror_pool(relay->server);
+    }
+
+    struct epoll_event ev = {.events = 0, .data.ptr = &relay->sides[1]};
+    if (epoll_ctl(epoll_fd, pooled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, relay->fds[1], &ev) == -1)
+    {
+        perror("Error: Failed to watch relay socket");
+        close_relay(relay);
+        return false;
+    }
+    if (!relay_update_events(relay))
+    {
+        close_relay(relay);
+        return false;
+    }
+    return true;
+}
+
+// Moves the client to a connection of its own once nothing more comes for it over a shared one, whose replies
+// would otherwise be overtaken. Until then it is called again whenever a reply is through. Returns false once
+// the relay is gone.
+bool relay_leave_shared(relay_t *relay) {
+    if (relay->outstanding > 0 || relay->replies_sent < relay->replies_length)
+    {
+        return true;
+    }
+    return relay_start_splice(relay);
+}
+
+// Passes on the complete commands the client has sent while it has no mirror connection of its own. Short
+// requests go over a shared connection, an archive request or a text command moves the client to a
+// connection of its own. Returns false once the relay is gone.
+bool relay_take_requests(relay_t *relay) {
+    while (relay->received_length > 0)
+    {
+        char *data = relay->received;
+        if ((uint8_t)data[0] != FRAME_MAGIC)
+        {
+            char *newline = memchr(data, '\n', relay->received_length);
+            if (newline == NULL && relay->received_length < sizeof(relay->received))
+            {
+                return true; // Wait for the rest of the command
+            }
+            if (relay->mode == RELAY_WAITING && newline != NULL && strncmp(data, "w24hello", 8) == 0 && (data[8] == '\n' || data[8] == ' '))
+            {
+                // Every mirror would answer the same, the client hears it from here before the mirror is picked
+                if (!relay_queue_reply(relay, "w24ok\n", 6))
+                {
+                    return false;
+                }
+                relay->received_length -= newline - data + 1;
+                memmove(data, newline + 1, relay->received_length);
+                continue;
+            }
+            return relay_leave_shared(relay);
+        }
+
+        if (relay->received_length < FRAME_HEADER_SIZE)
+        {
+            return true; // Wait for the rest of the header
+        }
+        frame_header_t header;
+        memcpy(&header, data, sizeof(header));
+        uint64_t length = be64toh(header.length);
+        if (header.type != FRAME_REQUEST || length > MAX_FRAME_COMMAND)
+        {
+            fprintf(stderr, "Error: Malformed frame from client\n");
+            close_relay(relay);
+            return false;
+        }
+        size_t size = FRAME_HEADER_SIZE + length;
+        if (relay->received_length < size || relay->outstanding >= MAX_PIPELINED)
+        {
+            return true; // Wait for the rest of the payload, or for replies
+        }
+
+        char command[MAX_FRAME_COMMAND + 1];
+        memcpy(command, data + FRAME_HEADER_SIZE, length);
+        command[length] = '\0';
+        if (is_archive_command(command))
+        {
+            return relay_leave_shared(relay);
+        }
+
+        // quitc would make the mirror close a shared connection on everyone, the client is let go here instead
+        if (strncmp(command, "quitc", 5) == 0 && (command[5] == '\0' || command[5] == ' ' || command[5] == '\n'))
+        {
+            printf("Client requested to exit\n");
+            relay->done[0] = true;
+            relay->received_length = 0;
+            return true;
+        }
+        if (relay->mux == NULL && (relay->mux = choose_mux_link(relay->server)) == NULL)
+        {
+            return relay_leave_shared(relay); // No shared connection is up yet
+        }
+        relay->mode = RELAY_SHARED;
+        mux_send(relay, data, size);
+        relay->received_length -= size;
+        memmove(data, data + size, relay->received_length);
+    }
+    return true;
+}
+
+// Reads the client's commands while it has no mirror connection of its own, and closes the relay once the
+// client has left and every reply is through
+void relay_receive(relay_t *relay) {
+    while (1)
+    {
+        if (!relay_take_requests(relay) || relay->mode == RELAY_SPLICE)
+        {
+            return;
+        }
+        if (relay->done[0] || relay->received_length == sizeof(relay->received) || relay->outstanding >= MAX_PIPELINED)
+        {
+            break;
+        }
+        ssize_t received = recv(relay->fds[0], relay->received + relay->received_length, sizeof(relay->received) - relay->received_length, 0);
+        if (received > 0)
+        {
+            relay->received_length += received;
+            continue;
+        }
+        if (received == 0)
+        {
+            relay->done[0] = true; // Commands already complete are still passed on
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN)
+        {
+            close_relay(relay);
+            return;
+        }
+        break;
+    }
+
+    if (!relay_flush_replies(relay) || (relay->done[0] && relay->outstanding == 0 && relay->replies_sent == relay->replies_length) ||
+        !relay_update_events(relay))
+    {
+        close_relay(relay);
+    }
+}
+
+// Handles readiness on either socket of a relay
+void relay_event(relay_side_t *side) {
+    relay_t *relay = side->relay;
+
+    if (relay->mode != RELAY_SPLICE)
+    {
+        // Only the client socket is watched
+        if (!relay_flush_replies(relay))
+        {
+            close_relay(relay);
+            return;
+        }
+        relay_receive(relay);
+        return;
+    }
+
+    if (relay->connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(relay->fds[1], SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0)
+        {
+            fprintf(stderr, "Error: Failed to setup connection to mirror server: %s\n", strerror(error));
+            fail_over_relay(relay);
+            return;
+        }
+        relay->connecting = false;
+    }
+
+    for (int direction = 0; direction < 2; direction++)
+    {
+        if (!relay_pump(relay, direction))
+        {
+            close_relay(relay);
+            return;
+        }
+        if (relay->client_left)
+        {
+            recycle_mirror_socket(relay->fds[1], relay->server);
+            relay->fds[1] = -1;
+            close_relay(relay);
+            return;
+        }
+    }
+
+    // Both sides have closed, the client is done with the mirror
+    if ((relay->done[0] && relay->done[1]) || !relay_update_events(relay))
+    {
+        close_relay(relay);
+    }
+}
+
+// Starts relaying a client to a mirror for the lifetime of the connection. Bytes the client has already sent
+// elsewhere are passed on first.
+void start_relay(int client_socket, int server, const char *received, size_t length) {
+    relay_t *relay = calloc(1, sizeof(relay_t));
+    relay->server = server;
+    relay->fds[0] = client_socket;
+    relay->fds[1] = -1;
+    relay->pipes[0][0] = relay->pipes[0][1] = relay->pipes[1][0] = relay->pipes[1][1] = -1;
+    __atomic_add_fetch(&server_load[server].connections, 1, __ATOMIC_RELAXED);
+
+    if (pipe2(relay->pipes[0], O_NONBLOCK | O_CLOEXEC) == -1 || pipe2(relay->pipes[1], O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        perror("Error: Failed to set up relay to mirror server");
+        close_relay(relay);
+        return;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        relay->sides[i].kind = WATCH_RELAY;
+        relay->sides[i].relay = relay;
+    }
+    struct epoll_event ev = {.events = 0, .data.ptr = &relay->sides[0]};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) == -1)
+    {
+        perror("Error: Failed to watch relay socket");
+        close_relay(relay);
+        return;
+    }
+
+    // Which mirror connection the client uses depends on how it talks, which its first command shows
+    memcpy(relay->received, received, length);
+    relay->received_length = length;
+    relay_receive(relay);
+}
+
+// Accepts every pending connection and decides which server handles it
+void accept_clients(int server_socket) {
+    static int clients_count = 0;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len;
+
+    while (1)
+    {
+        // Accept incoming connections
+        client_addr_len = sizeof(client_addr);
+        int client_socket = accept4(server_socket, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Error: Failed to accept connection");
+            }
+            return;
+        }
+
+        printf("\nClient connected: %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        clients_count++; // Increment count of clients.
+        printf("Client %d ", clients_count);
+        route_client(client_socket, NULL, 0);
+        printf("No. of Clients handled: %d\n", clients_count);
+    }
+}
+
+// Sends the client to whichever server is expected to answer it soonest, along with whatever it has already
+// sent to a mirror that failed
+void route_client(int client_socket, const char *received, size_t length) {
+    int server = choose_server();
+    printf("handled by %s\n", servers[server].name);
+    if (server == 0 || redirect_mode)
+    {
+        client_conn_t *conn = add_connection(client_socket);
+        if (conn)
+        {
+            conn->redirect_to = server;
+            if (length > 0)
             {
-                clients_count++; // Increment count of clients.
-                printf("No. of Clients handled: %d\n", clients_count);
-                // Parent process
-                close(client_socket); // Close unused client socket
+                memcpy(conn->message, received, length);
+                conn->length = length;
+                process_messages(conn);
             }
         }
-        
-        else if ((clients_count >= 6 &&  clients_count < 9)|| (clients_count >= 9 && clients_count % 3 == 2))
+    }
+    else
+    {
+        start_relay(client_socket, server, received, length);
+    }
+}
+
+// Event loop: accepts clients, reads their commands and takes connections back from the workers
+void run_event_loop(int server_socket) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_fd == -1)
+    {
+        perror("Error: Failed to set up the event loop");
+        exit(1);
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listener_tag};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+    ev.data.ptr = &wake_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    start_index_watcher();
+    start_worker_pool();
+    start_compress_pool();
+    start_mirror_pools();
+    send_timeout_ms = 0; // The loop only writes what fits in the socket buffer, a full one drops the client
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, expire_draining_links());
+        if (ready == -1)
         {
-            pid_t pid = fork();
-            if (pid == -1)
+            if (errno == EINTR)
             {
-                close(client_socket);
-                perror("Error: Coult not fork to handle client");
                 continue;
             }
-            else if (pid == 0)
+            perror("Error: epoll_wait failed");
+            exit(1);
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            client_conn_t *conn = events[i].data.ptr;
+            if (conn == &listener_tag)
+            {
+                accept_clients(server_socket);
+            }
+            else if (conn == &wake_tag)
+            {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                {
+                    perror("Error: Failed to read wake-up counter");
+                }
+
+                // Take back the connections whose jobs are finished
+                pthread_mutex_lock(&done_lock);
+                job_t *done = done_list;
+                done_list = NULL;
+                pthread_mutex_unlock(&done_lock);
+                while (done)
+                {
+                    job_t *next = done->next;
+                    finish_job(done);
+                    done = next;
+                }
+            }
+            else if (conn->kind == WATCH_RELAY)
+            {
+                relay_event((relay_side_t *)conn);
+            }
+            else if (conn->kind == WATCH_LINK)
+            {
+                link_event((mirror_link_t *)conn);
+            }
+            else if (conn->kind == WATCH_MUX)
             {
-                // Child process
-                printf("Client %d handled by the Mirror 2\n", clients_count + 1);
-                close(server_socket); // Close unused server socket
-                handle_mirror2(client_socket);
-                exit(EXIT_SUCCESS);
+                mux_event((mux_link_t *)conn);
             }
             else
             {
-                clients_count++; // Increment count of clients.
-                printf("No. of Clients handled: %d\n", clients_count);
-                // Parent process
-                close(client_socket); // Close unused client socket
+                read_client(conn);
+            }
+        }
+    }
+}
+
+// Creates a listening socket, SO_REUSEPORT lets every acceptor process bind its own socket to the same port
+int create_listener(int port) {
+    int listen_socket, opt = 1;
+    struct sockaddr_in server_addr;
+
+    // Create a non-blocking socket for the event loop
+    listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_socket == -1)
+    {
+        perror("Error: Failed to create socket");
+        exit(1);
+    }
+
+    // Set socket options to reuse address and port, these are two separate options
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        perror("Error: Failed to set socket options");
+        exit(1);
+    }
+
+    // Configure server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    server_addr.sin_port = htons(port);
+
+    // Bind the server address to the socket
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+    {
+        perror("Error: Failed to bind socket");
+        exit(1);
+    }
+
+    // Listen for incoming connections
+    if (listen(listen_socket, MAX_CLIENTS) == -1)
+    {
+        perror("Error: Failed to listen");
+        exit(1);
+    }
+    return listen_socket;
+}
+
+// Forks one acceptor process that runs the event loop on its own listener
+pid_t spawn_acceptor(int index, int *listeners, int count) {
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("Error: Could not fork acceptor process");
+    }
+    else if (pid == 0)
+    {
+        // Child process keeps only its own listener, the kernel spreads new connections across them
+        for (int i = 0; i < count; i++)
+        {
+            if (i != index)
+            {
+                close(listeners[i]);
+            }
+        }
+        printf("Acceptor %d (pid %d) waiting for connections\n", index + 1, (int)getpid());
+        run_event_loop(listeners[index]);
+        exit(EXIT_SUCCESS);
+    }
+    return pid;
+}
+
+// Pre-forks the acceptor processes and restarts any of them that dies
+void run_acceptors(int port, int count) {
+    int listeners[MAX_ACCEPTORS];
+    pid_t pids[MAX_ACCEPTORS];
+    acceptor_count = count;
+    archive_cache_limit = ARCHIVE_CACHE_BYTES / (size_t)count;
+
+    // All listeners are created up front so a bind error stops the server instead of a restart loop.
+    // The parent keeps them open, connections queued on a dead acceptor's socket wait for its replacement.
+    for (int i = 0; i < count; i++)
+    {
+        listeners[i] = create_listener(port);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pids[i] = spawn_acceptor(i, listeners, count);
+    }
+    index_behind = true; // Acceptors forked from now on replace one that died
+
+    while (1)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error: wait failed");
+            exit(1);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (pids[i] == pid)
+            {
+                fprintf(stderr, "Acceptor %d (pid %d) exited, starting a new one\n", i + 1, (int)pid);
+                sleep(1); // Avoid spinning if the acceptor keeps crashing
+                pids[i] = spawn_acceptor(i, listeners, count);
+            }
+        }
+    }
+}
+
+// Adds a mirror the main server routes clients to
+void add_backend(const char *ip, int port) {
+    if (num_servers == MAX_SERVERS)
+    {
+        fprintf(stderr, "Error: At most %d backends are supported\n", MAX_BACKENDS);
+        exit(1);
+    }
+    server_info_t *server = &servers[num_servers];
+    snprintf(server->name, sizeof(server->name), "the Mirror %d", num_servers);
+    snprintf(server->ip, sizeof(server->ip), "%s", ip);
+    server->port = port;
+    num_servers++;
+}
+
+// Reads the cluster config file. One setting per line, anything after # is a comment:
+//   role front|backend      listen <port>      workers <acceptor processes>
+//   routing least|p2c       redirect on|off    backend <ip> <port>   (one line per mirror)
+//   index <snapshot file>
+void load_config(const char *path, long *count) {
+    FILE *config = fopen(path, "r");
+    if (config == NULL)
+    {
+        perror("Error: Failed to open config file");
+        exit(1);
+    }
+
+    char line[MAX_CONFIG_LINE];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), config) != NULL)
+    {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment)
+        {
+            *comment = '\0';
+        }
+
+        char key[32], value[MAX_PATH_LENGTH], extra[32];
+        int port;
+        struct in_addr address;
+        int fields = sscanf(line, "%31s %4095s %31s", key, value, extra);
+        if (fields <= 0)
+        {
+            continue; // Blank line or only a comment
+        }
+
+        bool valid = true;
+        if (strcmp(key, "role") == 0 && fields == 2 && strcmp(value, "front") == 0)
+        {
+            server_role = ROLE_FRONT;
+        }
+        else if (strcmp(key, "role") == 0 && fields == 2 && strcmp(value, "backend") == 0)
+        {
+            server_role = ROLE_BACKEND;
+        }
+        else if (strcmp(key, "listen") == 0 && fields == 2)
+        {
+            servers[0].port = atoi(value);
+            valid = servers[0].port > 0 && servers[0].port < 65536;
+        }
+        else if (strcmp(key, "workers") == 0 && fields == 2)
+        {
+            *count = atol(value);
+        }
+        else if (strcmp(key, "routing") == 0 && fields == 2 && strcmp(value, "least") == 0)
+        {
+            routing_policy = ROUTE_LEAST_LOADED;
+        }
+        else if (strcmp(key, "routing") == 0 && fields == 2 && strcmp(value, "p2c") == 0)
+        {
+            routing_policy = ROUTE_TWO_CHOICES;
+        }
+        else if (strcmp(key, "redirect") == 0 && fields == 2 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+        {
+            redirect_mode = strcmp(value, "on") == 0;
+        }
+        else if (strcmp(key, "index") == 0 && fields == 2)
+        {
+            snprintf(index_snapshot_path, sizeof(index_snapshot_path), "%s", value);
+        }
+        else if (strcmp(key, "backend") == 0 && fields == 3 && inet_pton(AF_INET, value, &address) == 1)
+        {
+            port = atoi(extra);
+            valid = port > 0 && port < 65536;
+            if (valid)
+            {
+                add_backend(value, port);
             }
         }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "Error: %s:%d: invalid setting\n", path, line_number);
+            exit(1);
+        }
+    }
+    fclose(config);
+}
 
+// Reads the command line options: -c loads a config file, -b runs this server as a backend (mirror),
+// -p sets the port to listen on, -w the number of acceptor processes (one per CPU by default),
+// -r the routing policy of the main server, -R turns on redirect mode and -i sets the index snapshot file.
+// Options are applied in order, so they override the settings of a config file given before them.
+int parse_options(int argc, char *argv[]) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    bool configured = false;
+    int option;
+    while ((option = getopt(argc, argv, "c:bp:w:r:Ri:")) != -1)
+    {
+        if (option == 'c')
+        {
+            load_config(optarg, &count);
+            configured = true;
+        }
+        else if (option == 'b')
+        {
+            server_role = ROLE_BACKEND;
+        }
+        else if (option == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536)
+        {
+            servers[0].port = atoi(optarg);
+        }
+        else if (option == 'w')
+        {
+            count = atol(optarg);
+        }
+        else if (option == 'R')
+        {
+            redirect_mode = true;
+        }
+        else if (option == 'i')
+        {
+            snprintf(index_snapshot_path, sizeof(index_snapshot_path), "%s", optarg);
+        }
+        else if (option == 'r' && strcmp(optarg, "least") == 0)
+        {
+            routing_policy = ROUTE_LEAST_LOADED;
+        }
+        else if (option == 'r' && strcmp(optarg, "p2c") == 0)
+        {
+            routing_policy = ROUTE_TWO_CHOICES;
+        }
         else
-        	printf("No Server to handle the client\n");
+        {
+            fprintf(stderr, "Usage: %s [-c config_file] [-b] [-p port] [-w acceptor_processes] [-r least|p2c] [-R] [-i index_snapshot]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (server_role == ROLE_BACKEND)
+    {
+        num_servers = 1; // A backend never routes clients any further
+    }
+    else if (!configured)
+    {
+        // Without a config file the main server uses the two mirrors of the original setup
+        add_backend(SERVER_IP, 8081);
+        add_backend(SERVER_IP, 8083);
+    }
+
+    if (count < 1)
+    {
+        count = 1;
+    }
+    if (count > MAX_ACCEPTORS)
+    {
+        count = MAX_ACCEPTORS;
+    }
+    return (int)count;
+}
+
+int main(int argc, char *argv[])
+{
+    int acceptors = parse_options(argc, argv);
+
+    // A client that disconnects in the middle of a transfer must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    // Line buffered output so the logs of the acceptor processes show up as they happen
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    init_routing();
+    // Every acceptor answers queries from the same index, loaded once before they are forked
+    const char *home = getenv("HOME");
+    if (home == NULL)
+    {
+        fprintf(stderr, "Error: HOME is not set\n");
+        exit(1);
     }
+    load_index(home);
+    if (num_servers > 1)
+    {
+        start_health_checker();
+    }
+
+    if (server_role == ROLE_BACKEND)
+    {
+        printf("Mirror server is listening on port %d with %d acceptor processes...\n", servers[0].port, acceptors);
+    }
+    else
+    {
+        printf("Server is listening on port %d with %d acceptor processes and %d mirrors...\n", servers[0].port, acceptors, num_servers - 1);
+    }
+
+    run_acceptors(servers[0].port, acceptors);
     return 0;
 }